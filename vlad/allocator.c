@@ -14,19 +14,95 @@
 //        out and indented.
 //
 
+#define _GNU_SOURCE   // for mremap()
+
 #include "allocator.h"
+#include "trace.h"
+#include "snapshot.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define HEADER_SIZE    sizeof(struct free_list_header)  
 #define MAGIC_FREE     0xDEADBEEF
 #define MAGIC_ALLOC    0xBEEFDEAD
+#define MAGIC_ALIGNED  0xA11CDEAD // placed in front of aligned data
+#define MAGIC_QUICK    0xFEEDDEAD // freed block on a quick list
+#define MAGIC_MARKED   0xBEEFFEED // allocated block on the mark list
+#define MAGIC_MARK     0x3A4BDEAD // mark set by vlad_arena_mark()
+#define MAGIC_HUGE     0x0B16DEAD // in front of a huge block's data
+
+// Offsets and sizes in headers are 64 bits wide, so an arena can be far
+// bigger than 4GB. Build with -DVLAD_SMALL_HEADERS to keep 32-bit ones
+// (and 16-byte rather than 32-byte headers) when arenas stay under 4GB.
+#ifdef VLAD_SMALL_HEADERS
+#define MIN_ORDER      4    // log2(HEADER_SIZE): smallest block is one header
+#else
+#define MIN_ORDER      5
+#endif
+#define MAX_ORDERS     (8 * sizeof(vsize_t)) // one free list per block size
+
+// Each block's order and state are also kept out of line, in one byte
+// per 2^MIN_ORDER bytes of memory[], at the byte for its first unit.
+#define META_ORDER     0x3f // order of the block starting here
+#define META_ALLOC     0x40 // block starting here is allocated
+#define META_ZERO      0x80 // free block starting here is all zero after
+                            // its free list header
+#define CACHE_LINE     64   // arenas are padded apart to avoid false sharing
+
+#define SLAB_ORDER     12   // slabs are buddy blocks of 2^SLAB_ORDER bytes
+#define SLAB_SIZE      ((vsize_t)1 << SLAB_ORDER)
+#define SLAB_MAX       64   // largest request served from a slab
+#define SLAB_CLASSES   5    // number of entries in slab_sizes[]
+#define SLAB_WORDS     8    // 64-bit words in a slab's free-slot bitmap
+#define SLAB_MIN_ARENA (16 * SLAB_SIZE) // smaller arenas don't use slabs
+
+#define REMOTE_BATCH   64   // remote frees sorted and freed at a time
+
+#define SNAPSHOT_BLOCKS 4096 // most blocks walked per hold of a lock
+#define SNAPSHOT_RUNS   512  // runs buffered between writes
+
+#define QUICK_MAX_ORDER 16  // largest order kept on quick lists
+#define QUICK_LIMIT     32  // most blocks a quick list holds
+
+#define HUGE_MIN       (128 << 10) // requests of this many bytes or more,
+#define HUGE_FRACTION  4    // and more than an arena over this, are huge
+
+#define PURGE_MIN_ORDER 16  // smallest free block given back to the OS
+#define PURGE_DECAY_NS  1000000000ull // once it has been free this long
+#define PURGE_TICKS     64  // mallocs and frees between looks at the time
+
+#define PERSIST_MAGIC   0x564c4144 // "VLAD"
+#define PERSIST_VERSION 1
+#define PERSIST_NO_ROOT ((u_int64_t)-1)
+#define PAGE_SIZE_MIN   4096        // persistent file sections align to this
 
 typedef unsigned char byte;
+#ifdef VLAD_SMALL_HEADERS
 typedef u_int32_t vlink_t;
 typedef u_int32_t vsize_t;
 typedef u_int32_t vaddr_t;
+#else
+typedef u_int64_t vlink_t;
+typedef u_int64_t vsize_t;
+typedef u_int64_t vaddr_t;
+#endif
 
 typedef struct free_list_header {
    u_int32_t magic;  // ought to contain MAGIC_FREE
@@ -35,40 +111,518 @@ typedef struct free_list_header {
    vlink_t prev;     // memory[] index of previous free block
 } free_header_t;
 
+_Static_assert(HEADER_SIZE == VLAD_HEADER_SIZE,
+               "VLAD_HEADER_SIZE in allocator.h is out of date");
+
+// A slab is one buddy block of SLAB_SIZE bytes carved into equal slots
+// for a single size class. This header follows the slab's block header
+// and the slots follow it; the slots themselves carry no header at all.
+typedef struct slab_header {
+   u_int16_t size_class;  // index into slab_sizes[]
+   u_int16_t n_slots;     // # slots in this slab
+   u_int16_t n_free;      // # slots currently free
+   u_int16_t pad;
+   vlink_t next;          // memory[] index of next partial slab of this class
+   vlink_t prev;          // memory[] index of previous partial slab
+   u_int64_t free_slots[SLAB_WORDS]; // bit i set iff slot i is free
+} slab_header_t;
+
+#define SLAB_HEADER_SIZE ((HEADER_SIZE + sizeof(slab_header_t) + 15) & ~15u)
+
+// The first page of a persistent arena's file. Everything in the file is
+// an offset rather than a pointer, so the file can be mapped anywhere.
+// The arena's list heads are saved here on a clean close and restored
+// on open; the rest of its state lives in the file already.
+typedef struct persist_header {
+   u_int32_t magic;                    // ought to contain PERSIST_MAGIC
+   u_int32_t version;                  // ought to contain PERSIST_VERSION
+   u_int32_t header_size;              // HEADER_SIZE of the writing build
+   u_int32_t clean;                    // 1 iff closed cleanly
+   int32_t flags;                      // VLAD_* flags of the arena
+   u_int32_t slab_partial;
+   u_int64_t memory_size;
+   u_int64_t root;                     // memory[] index of the root object
+   u_int64_t free_orders;
+   u_int64_t free_lists[64];
+   u_int64_t slab_lists[SLAB_CLASSES];
+} persist_header_t;
+
+// In front of the data of a huge block, which is a mapping of its own.
+// The data starts offset bytes in, so that it can be aligned.
+typedef struct huge_header {
+   struct huge_header *next;  // next huge block, or NULL
+   struct huge_header *prev;  // previous huge block, or NULL
+   u_int64_t size;            // # bytes in the mapping
+   u_int32_t offset;          // # bytes from the mapping's start to the data
+   u_int32_t magic;           // ought to contain MAGIC_HUGE
+} huge_header_t;
+
+// Slot sizes of the slab classes, smallest first.
+static const u_int16_t slab_sizes[SLAB_CLASSES] = {8, 16, 32, 48, 64};
+
+// An arena is one independent buddy heap with its own lock.
+// Free blocks are kept on one circular list per order (block size 2^order).
+// Bit k of free_orders is set iff free_lists[k] is non-empty, so finding
+// the smallest usable block is a single find-first-set on the mask.
+typedef struct vlad_arena {
+   byte *memory;                     // pointer to start of arena memory
+   vsize_t memory_size;              // number of bytes in memory[]
+   vaddr_t free_lists[MAX_ORDERS];   // index in memory[] of first block
+   u_int64_t free_orders;            // occupancy bitmask of free_lists[]
+   pthread_mutex_t lock;             // held for every operation on the arena
+   int flags;                        // VLAD_* flags given at creation
+   byte *block_meta;                 // order/state of each block, see META_*
+
+   // Slabs with at least one free slot are kept on a circular list per
+   // size class, with the same bitmask scheme as the free lists.
+   // Bit p of slab_pages is set iff the SLAB_SIZE page p of memory[]
+   // is a slab; it is NULL if the arena is too small to use slabs.
+   vaddr_t slab_lists[SLAB_CLASSES]; // memory[] index of first partial slab
+   u_int32_t slab_partial;           // occupancy bitmask of slab_lists[]
+   u_int64_t *slab_pages;            // bitmap of pages that are slabs
+
+   // With VLAD_LAZY, freed blocks of up to QUICK_MAX_ORDER are not merged
+   // but kept whole on a singly linked quick list per order, still marked
+   // allocated so that no buddy merges with them, and handed straight
+   // back out. Once a list holds QUICK_LIMIT blocks, frees of its order
+   // merge as usual; all the lists are merged when no free block is big
+   // enough.
+   vaddr_t quick_lists[QUICK_MAX_ORDER + 1]; // memory[] index of first
+   u_int32_t quick_counts[QUICK_MAX_ORDER + 1]; // # blocks on each
+   u_int64_t quick_orders;           // occupancy bitmask of quick_lists[]
+   u_int64_t quick_times[QUICK_MAX_ORDER + 1]; // last filled or popped
+
+   // While any mark is set, every block handed out also goes on the end
+   // of a circular list, in the order it was allocated, linked through
+   // its header's next and prev (unused in an allocated block) and with
+   // magic MAGIC_MARKED; freeing it takes it off again. The marks are
+   // blocks on the list too, so rewinding to one frees from the newest
+   // block back to it. Slabs are not used meanwhile: their slots have no
+   // header to link through.
+   vaddr_t marked;                   // memory[] index of the oldest mark
+   u_int32_t n_marks;                // # marks set
+
+   // With VLAD_ADDRESS_ORDER, bit i of free_bits[k] is set iff a free
+   // block of order k starts at index i << k, and bit j of free_summary[k]
+   // iff word j of free_bits[k] is non-zero, so the lowest free block of
+   // an order is found by scanning a 4096th as many words as positions.
+   // They all lie in the one mapping at position_bits (NULL otherwise).
+   u_int64_t *free_bits[MAX_ORDERS];
+   u_int64_t *free_summary[MAX_ORDERS];
+   u_int64_t *position_bits;
+   size_t position_size;             // # bytes at position_bits
+
+   persist_header_t *persist;        // start of the file, if persistent
+
+   // Counters for vlad_get_stats(), kept up to date as blocks come and go.
+   u_int64_t free_counts[MAX_ORDERS]; // # blocks on each free list
+   u_int64_t live;                   // # objects allocated
+   u_int64_t splits;                 // # blocks halved so far
+   u_int64_t merges;                 // # buddy pairs merged so far
+   u_int64_t requested;              // # bytes asked for so far
+   u_int64_t granted;                // # bytes usable in what was given
+   u_int64_t purged;                 // # bytes given back to the OS so far
+
+   // Every free block of PURGE_MIN_ORDER or more that is not META_ZERO
+   // holds the time it was freed just past its header. On every
+   // PURGE_TICKS-th malloc or free, and any free that makes such a block,
+   // if PURGE_DECAY_NS / 4 has passed since the last look, the pages of
+   // those free for PURGE_DECAY_NS are given back to the OS, which leaves
+   // them zero, so the block is META_ZERO from then on. Blocks on the
+   // quick lists hold no time; a list is merged once it has been neither
+   // filled from empty nor popped for that long, as of the last look.
+   u_int64_t purge_next;             // time of the next look for them
+   u_int64_t purge_last;             // time of the last look
+   u_int32_t purge_ticks;            // maybePurge() calls till a look
+
+   // Objects freed by threads that allocate from another arena are
+   // pushed here without the lock, each holding the next one in its
+   // first word, and freed by whoever next allocates with the lock held.
+   // It is on a cache line of its own so that pushes do not slow the
+   // owner's use of the fields above.
+   void *remote_frees __attribute__((aligned(CACHE_LINE)));
+} __attribute__((aligned(CACHE_LINE))) arena_t;
+
 // Global data
 
-static byte *memory = NULL;   // pointer to start of allocator memory
-static vaddr_t free_list_ptr; // index in memory[] of first block in free list
-static vsize_t memory_size;   // number of bytes malloc'd in memory[]
+static byte *memory = NULL;   // pointer to start of all arenas' memory
+static vsize_t memory_size;   // number of bytes in each arena
+static arena_t *arenas;       // the arenas, back to back in memory[]
+static int n_arenas;          // number of entries in arenas[]
+
+static int next_arena;                  // round-robin counter for threads
+static __thread int thread_arena = -1;  // arena this thread allocates from
+
+// Bumped by each vlad_init_threads(), so that a thread_arena handed out
+// for an earlier heap, which may have had more arenas, is not used.
+static int heap_generation;
+static __thread int thread_generation;  // heap_generation of thread_arena
+
+// Once the arenas are full, further regions are added one at a time as
+// needed, each a separate arena of at least memory_size bytes, and given
+// back to the OS when they are free again. regions_lock is held for
+// reading over any use of a region, and for writing to add or drop one.
+static arena_t **regions;     // the regions, in address order
+static int n_regions;         // number of entries in regions[]
+static int max_regions;       // number of entries regions[] has room for
+static pthread_rwlock_t regions_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Requests too big to sit well in an arena are mapped straight from the
+// OS, one mapping each, and unmapped as soon as they are freed, so that
+// they neither split the arenas' big blocks nor hold on to memory. They
+// are kept on a list for vlad_reset() and vlad_end().
+static huge_header_t *huge_blocks;  // most recently mapped, or NULL
+static u_int64_t huge_bytes;        // # bytes mapped for them
+static u_int64_t huge_count;        // # of them
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// While vlad_trace_start() is in effect, every call is also recorded
+// in the ring of a mapped trace file (see trace.h).
+static trace_header_t *trace;           // start of the file, or NULL
+static trace_record_t *trace_ring;      // the records, after the header
+static __thread u_int64_t trace_last;   // time of thread's last record
+
+static u_int64_t failed_allocs;  // # heap allocations that returned NULL
 
 
 // Miscellaneous functions prototypes:
 
 // Function to test if x is a power of two.
-int isPowerOfTwo (u_int32_t x);
+int isPowerOfTwo (vsize_t x);
 
 // Function that takes in an integer and returns 
 // the closest power of two that is higher than it.
-u_int32_t whatPowerUp(int n);
+vsize_t whatPowerUp(vsize_t n);
 
 // Function that takes in an integer and returns 
 // the closest power of two that is lower than it.
-u_int32_t whatPowerDown(int n);
+vsize_t whatPowerDown(vsize_t n);
+
+// Function that returns the order (log2) of a power-of-two block size.
+u_int32_t whatOrder(vsize_t size);
+
+// Function that returns the order of the smallest block that can hold
+// n bytes.
+u_int32_t whatOrderUp(size_t n);
+
+// Function that returns the size of a block of the given order.
+vsize_t whatSize(u_int32_t order);
+
+// Function that returns the # bytes in front of the data in an
+// allocated block of a: a header, or nothing for VLAD_NO_HEADERS arenas.
+u_int32_t whatHeaderSize(arena_t *a);
+
+// Function that returns the memory[] index of the block whose data
+// object points to, looking through any aligned placement.
+vaddr_t whatBlock(arena_t *a, void *object);
+
+// Records the order and state of the block at index in a->block_meta.
+void setMeta(arena_t *a, vaddr_t index, u_int32_t order, int allocated);
 
 // Function that returns the memory[] index of a given pointer to a header.
-vlink_t whatIndex(free_header_t *ptr);
+vlink_t whatIndex(arena_t *a, free_header_t *ptr);
 
 // Function that return the address of a given memory[] index.
-free_header_t *whatAddress(vaddr_t index);
+free_header_t *whatAddress(arena_t *a, vaddr_t index);
+
+// Function that returns the arena the calling thread allocates from,
+// assigning the thread one round-robin on its first call for this heap.
+arena_t *whatArena(void);
+
+// Function that returns the arena whose memory object lies in, or NULL
+// if it is not in one of arenas[] (it may be in a region).
+arena_t *whatOwner(void *object);
+
+// Function that returns the region object lies in, or NULL if none.
+// regions_lock must be held.
+arena_t *whatRegion(void *object);
+
+// Handlers for pthread_atfork(). Every lock is held over a fork, so the
+// child gets the heap in a consistent state, with its locks free.
+void forkPrepare(void);
+void forkParent(void);
+void forkChild(void);
+
+// vlad_malloc/vlad_free/vlad_calloc/vlad_memalign on the whole heap,
+// without tracing.
+void *heapMalloc(size_t n);
+void heapFree(void *object);
+void *heapCalloc(size_t count, size_t size);
+void *heapMemalign(size_t alignment, size_t n);
+
+// Resizes object to hold n bytes without copying it, and returns where
+// it is now, or NULL if it must be moved. Sets *size to the # bytes it
+// held before.
+void *heapResize(void *object, size_t n, size_t *size);
+
+// Hands object, which lies in one of arenas[], to a's remote-free queue.
+void pushRemote(arena_t *a, void *object);
+
+// Frees everything on a's remote-free queue, with its lock held.
+void drainRemote(arena_t *a);
+
+// Appends one record to the trace, or for traceRealloc fills in the
+// pair of records, from slot on, for a realloc from old to moved.
+void traceRecord(u_int32_t op, size_t size, void *object);
+void traceRealloc(u_int64_t slot, size_t n, void *old, void *moved);
+
+// Fills in trace record number slot.
+void traceWrite(u_int64_t slot, u_int32_t op, size_t size, void *object);
+
+// Gives back to the OS the pages of a's free blocks that have been free
+// for at least decay nanoseconds by now, with a's lock held, and returns
+// how many bytes that was.
+size_t purgeArena(arena_t *a, u_int64_t now, u_int64_t decay);
+
+// As purgeArena() with no decay, after merging what is on a's quick and
+// remote-free lists and giving back its empty slabs.
+size_t arenaPurge(arena_t *a);
+
+// Gives back the pages of a's blocks that have been free for
+// PURGE_DECAY_NS, with its lock held, if it is time to look again.
+void maybePurge(arena_t *a);
+
+// Gives back the pages of the free block ptr is pointing to, all but
+// the one its header is on, which is cleared instead. Returns the #
+// bytes given back, or 0 if that failed and the block is as it was.
+size_t purgeBlock(free_header_t *ptr);
+
+// Function that returns where the free block ptr is pointing to holds
+// the time it was freed.
+u_int64_t *whatFreeTime(free_header_t *ptr);
+
+// Function that returns the time in nanoseconds, to a few milliseconds.
+u_int64_t whatCoarseTime(void);
+
+// Function that returns the OS's page size.
+size_t whatPageSize(void);
+
+// Sets a mark in a, with its lock held, and returns the mark's block,
+// or NULL if there is no room or a cannot have marks.
+free_header_t *arenaMark(arena_t *a);
+
+// Frees every block allocated in a since mark, with its lock held, along
+// with mark itself and any marks set after it.
+void arenaRewind(arena_t *a, free_header_t *mark);
+
+// Adds the allocated block ptr is pointing to to the end of a's mark
+// list, or takes it off.
+void trackBlock(arena_t *a, free_header_t *ptr);
+void untrackBlock(arena_t *a, free_header_t *ptr);
+
+// Writes the section of a snapshot for arena a, or if a is NULL for the
+// region whose memory starts at region, to fd. A region is looked up
+// afresh for each chunk, and the section cut short if it has gone.
+// Returns 0, or -1 if writing failed.
+int snapshotArena(arena_t *a, byte *region, int fd);
+
+// Walks up to SNAPSHOT_BLOCKS blocks of a from index, with its lock
+// held, adding them to the *n runs in runs[] (at most SNAPSHOT_RUNS).
+// Returns the index to carry on from.
+vaddr_t snapshotChunk(arena_t *a, vaddr_t index, snapshot_run_t *runs,
+                      int *n);
+
+// Function that returns the SNAPSHOT_* state of the block at index,
+// whose metadata byte is meta.
+u_int32_t whatSnapshotState(arena_t *a, vaddr_t index, byte meta);
+
+// Function that returns the memory[] index of the block index lies in.
+vaddr_t whatContainingBlock(arena_t *a, vaddr_t index);
+
+// Writes n bytes to fd, however many calls that takes. Returns 0, or -1
+// if writing failed.
+int writeAll(int fd, const void *buffer, size_t n);
+
+// vlad_memalign, or vlad_calloc if isZero, on the regions, adding a new
+// region if none has room.
+void *regionMalloc(size_t alignment, size_t n, int isZero);
+
+// vlad_memalign, or vlad_calloc if isZero, on the regions there are.
+// regions_lock must be held.
+void *regionsMalloc(size_t alignment, size_t n, int isZero);
+
+// vlad_free on an object in no arena: a region's, or else a huge block.
+// Drops the region if it is left free.
+void regionFree(void *object);
+
+// Gives back to the OS every free region but one, which is kept in
+// case it is needed again soon.
+void releaseRegions(void);
+
+// Function that returns whether a request for n bytes is huge, and so
+// mapped on its own rather than taken from an arena.
+int isHugeSize(size_t n);
+
+// Maps a huge block of n bytes, its data a multiple of alignment (a
+// power of two), and returns the data, or NULL if it cannot be mapped.
+void *hugeMalloc(size_t alignment, size_t n);
+
+// Unmaps the huge block h is in front of.
+void hugeFree(huge_header_t *h);
+
+// Resizes the huge block h is in front of to hold n bytes, moving its
+// pages rather than copying them if it must move, and returns its data,
+// or NULL if that cannot be done (it is then as it was).
+void *hugeResize(huge_header_t *h, size_t n);
+
+// Unmaps every huge block.
+void releaseHuge(void);
+
+// Function that returns the header of the huge block whose data object
+// is, or NULL if it is not one.
+huge_header_t *whatHuge(void *object);
+
+// Adds h to, or removes it from, the list of huge blocks. huge_lock
+// must be held.
+void pushHuge(huge_header_t *h);
+void unlinkHuge(huge_header_t *h);
+
+// Function that returns whether nothing in a is allocated, giving back
+// any empty slabs kept if they are all that is.
+int arenaUnused(arena_t *a);
+
+// Sets up a as a single free block of size bytes starting at mem.
+// Returns 0, or -1 if the arena's metadata cannot be allocated.
+int arenaInit(arena_t *a, byte *mem, vsize_t size, int flags);
+
+// Makes a's memory one free block again, forgetting every allocation.
+// isZero says whether the memory is known to be all zero.
+void arenaFormat(arena_t *a, int isZero);
+
+// Releases a's lock and metadata, but not its memory.
+void arenaEnd(arena_t *a);
+
+// Function that works out where the sections of a persistent arena of
+// the given size go in its file, and returns the total file size.
+size_t whatPersistLayout(vsize_t size, size_t *metaAt, size_t *slabAt,
+                         size_t *memAt);
+
+// Copies a's list heads between the arena and its persist header.
+void persistSave(arena_t *a);
+void persistLoad(arena_t *a);
+
+// Function that gets size bytes of zeroed memory straight from the OS.
+// Pages are only committed as they are first touched, so this takes the
+// same time for any size. The memory starts on a multiple of align (a
+// power of two, or 0 for any page). VLAD_HUGE_PAGES in flags asks for
+// huge pages.
+void *mapMemory(size_t size, size_t align, int flags);
+
+// Function that reserves size bytes of address space such that the byte
+// at offset `at` lies on a multiple of align, and returns its start.
+byte *reserveAligned(size_t size, size_t align, size_t at);
+
+// Function that returns the # bytes in the slab_pages bitmap of an
+// arena of the given size.
+size_t whatSlabPagesSize(vsize_t size);
+
+// Function that lays a's position bitmaps out from bits, or only counts
+// them if bits is NULL, and returns the # bytes they take.
+size_t whatPositionLayout(arena_t *a, u_int64_t *bits);
+
+// vlad_malloc/vlad_free/vlad_calloc on a single arena, with its lock held.
+// arenaMallocOrder() is given n's buddy order, or 0 to work it out.
+void *arenaMalloc(arena_t *a, size_t n);
+void *arenaMallocOrder(arena_t *a, size_t n, u_int32_t order);
+void *arenaMemalign(arena_t *a, size_t alignment, size_t n);
+void arenaFree(arena_t *a, void *object);
+void *arenaCalloc(arena_t *a, size_t n);
+
+// Resizes the region object points to, to hold n bytes, without moving
+// it. Returns 1 if that could be done, 0 if the region must move.
+int arenaResize(arena_t *a, void *object, size_t n);
+
+// Function that returns the # bytes usable at object.
+size_t whatUsableSize(arena_t *a, void *object);
+
+// vlad_malloc/vlad_free on the arena's buddy blocks, bypassing slabs.
+// If isZero is not NULL, *isZero is set to whether the block was known
+// to be zero (past where its free list header was) before allocation.
+// buddyMallocOrder() is given the order of block n needs, which must
+// fit in the arena.
+void *buddyMalloc(arena_t *a, size_t n, int *isZero);
+void *buddyMallocOrder(arena_t *a, size_t n, u_int32_t order, int *isZero);
+void buddyFree(arena_t *a, void *object);
+
+// Function that checks object is the data of an allocated block, and
+// returns that block with its header's size filled in.
+free_header_t *checkAllocated(arena_t *a, void *object);
+
+// Merges the block ptr is pointing to with its buddies for as long as
+// they are free, then puts the result on its free list.
+void coalesce(arena_t *a, free_header_t *ptr);
+
+// Adds the freed block ptr is pointing to to the quick list for its
+// order, or merges it if that list is full.
+void pushQuick(arena_t *a, free_header_t *ptr);
+
+// Takes the first block off the quick list for order.
+free_header_t *popQuick(arena_t *a, u_int32_t order);
+
+// Merges every block on a's quick lists into the free lists.
+void flushQuick(arena_t *a);
+
+// vlad_malloc_batch/vlad_free_batch on a single arena, with its lock
+// held. The objects given to arenaFreeBatch must be in address order.
+int arenaMallocBatch(arena_t *a, size_t n, int count, void **objects);
+void arenaFreeBatch(arena_t *a, void **objects, int count);
+
+// Puts the free region from index to end onto the free lists, as the
+// fewest buddy blocks, and returns how many that was. end must be the
+// end of a block index lies in, freed at time freed unless isZero.
+int pushFreeTail(arena_t *a, vaddr_t index, vaddr_t end, int isZero,
+                 u_int64_t freed);
+
+// Counts an allocation of n bytes, given object, for vlad_get_stats(),
+// and puts it on the mark list if a mark is set.
+void countAlloc(arena_t *a, size_t n, void *object);
+
+// Orders pointers by address, for qsort().
+int compareAddress(const void *x, const void *y);
+
+// vlad_malloc/vlad_free on the arena's slabs, for n <= SLAB_MAX.
+void *slabMalloc(arena_t *a, size_t n);
+void slabFree(arena_t *a, void *object);
+
+// Function that returns the slab header of the slab object lies in,
+// or NULL if object is not in a slab.
+slab_header_t *whatSlab(arena_t *a, void *object);
+
+// Gives the empty slabs kept for each class back to the buddy blocks.
+// Returns the number of slabs released.
+int releaseSlabs(arena_t *a);
+
+// Sets or clears the slab_pages bit for the page starting at page.
+void setSlabPage(arena_t *a, byte *page, int isSlab);
+
+// Adds the slab to, or removes it from, the partial list for its class.
+void pushSlab(arena_t *a, slab_header_t *slab);
+void unlinkSlab(arena_t *a, slab_header_t *slab);
+
+// Marks the block ptr is pointing to as free and adds it
+// to the free list for its order.
+void pushFree(arena_t *a, free_header_t *ptr);
+
+// Sets or clears the position bit of the block of the given order at
+// index, for VLAD_ADDRESS_ORDER arenas.
+void setPositionBit(arena_t *a, vaddr_t index, u_int32_t order, int isFree);
+
+// Function that returns the memory[] index of the free block of the
+// given order to allocate next: the lowest one for VLAD_ADDRESS_ORDER
+// arenas, else the head of its free list.
+vaddr_t whatFirstFree(arena_t *a, u_int32_t order);
+
+// Function that returns the index of the first non-zero word of words,
+// or count if there is none.
+size_t whatNonZeroWord(const u_int64_t *words, size_t count);
+
+// Removes the block ptr is pointing to from the free list for its order.
+void unlinkFree(arena_t *a, free_header_t *ptr);
 
 // Function that splits the block of memory ptr is pointing to
 // into two equal-sized blocks, returning a pointer to the new block
-// at the halfway point.
-free_header_t *insertHalve(free_header_t *ptr); 
-
-// Determines if new block to be allocated 
-// is correct size for allocating n bytes
-int sizeOK (free_header_t *header, u_int32_t n);
+// at the halfway point. The new block is put on its free list.
+free_header_t *insertHalve(arena_t *a, free_header_t *ptr); 
 
 // Determines if memory block is a valid FREE block;
 int magicFreeOK(free_header_t *header);
@@ -76,16 +630,9 @@ int magicFreeOK(free_header_t *header);
 // Determines if memory block is a valid ALLOCATED block;
 int magicAllocOK(free_header_t *header);
 
-// Determines if a block of memory pointed to by ptr
-// can be merged with the block NEXT to it.
-int canMergeNext(free_header_t *ptr);
-
-// Determines if a block of memory at index with size = size was
-// split from the region consisting it and the block NEXT to it.
-int wasSplit(vlink_t index, vsize_t size);
-
-// Merges the block of memory with the block NEXT to it.
-void merge_with_next(free_header_t *ptr);
+// Returns the free buddy of the block ptr is pointing to,
+// or NULL if its buddy is not currently free and whole.
+free_header_t *findBuddy(arena_t *a, free_header_t *ptr);
 
 
 
@@ -97,25 +644,68 @@ void merge_with_next(free_header_t *ptr);
 // (If the allocator is already initialised, this function does nothing,
 //  even if it was initialised with different size)
 
-void vlad_init(u_int32_t size)
+void vlad_init(size_t size)
+{
+   vlad_init_threads(size, 1);
+}
+
+
+// Input: size - number of bytes in each arena
+//        n - number of arenas, or <= 0 for one per online CPU
+// Output: none
+// Precondition: size is a power of two.
+// Postcondition: n * size bytes are now available to the allocator,
+//                as n independently locked arenas
+//
+// (If the allocator is already initialised, this function does nothing)
+
+void vlad_init_threads(size_t size, int n)
 {
+   static int forkSafe = 0;
+   if (arenas != NULL) {
+      return;
+   }
+   if (!forkSafe) {
+      pthread_atfork(forkPrepare, forkParent, forkChild);
+      forkSafe = 1;
+   }
+   if (size > whatSize(MAX_ORDERS - 1)) {
+      fprintf(stderr, "vlad_init: arena size too large\n");
+      abort();
+   }
    if (!isPowerOfTwo(size)) {
       size = whatPowerUp(size);
    }
+   if (n <= 0) {
+      n = sysconf(_SC_NPROCESSORS_ONLN);
+      if (n <= 0) {
+         n = 1;
+      }
+   }
 
+   // Nothing here comes from malloc(), so that vlad can stand in for
+   // malloc() itself (see shim.c).
    memory_size = size;
-   memory = malloc(memory_size);
+   memory = mapMemory((size_t)n * memory_size, memory_size, 0);
+   arenas = mapMemory(n * sizeof(arena_t), 0, 0);
+   if (memory == NULL || arenas == NULL) {
+      fprintf(stderr, "vlad_init: cannot allocate memory\n");
+      abort();
+   }
+   n_arenas = n;
+   heap_generation++;
 
       //printf("memory_size is %d\n", size);
 
-   free_header_t *header = (free_header_t *) memory;
-
-   header->magic = MAGIC_FREE;
-   header->size = size;
-   header->next = 0;
-   header->prev = 0;
-
-   free_list_ptr = 0;
+   int i;
+   for (i = 0; i < n_arenas; i++) {
+      byte *mem = memory + (size_t)i * memory_size;
+      if (arenaInit(&arenas[i], mem, memory_size,
+                    VLAD_LAZY | VLAD_ADDRESS_ORDER) < 0) {
+         fprintf(stderr, "vlad_init: cannot allocate memory\n");
+         abort();
+      }
+   }
 }
 
 
@@ -126,227 +716,358 @@ void vlad_init(u_int32_t size)
 //                Else, p points to a location immediately after a header block
 //                      for a newly-allocated region of some size >= 
 //                      n + header size.
+//                Requests of up to 64 bytes in arenas of 64KB or more
+//                are served from headerless slab slots instead, and
+//                huge ones from a mapping of their own.
 
-void *vlad_malloc(u_int32_t n)
+void *vlad_malloc(size_t n)
 {
-   free_header_t *ptr = (free_header_t *)(memory + free_list_ptr);
-      // printf("ptr is at %p index %d\n\n", ptr, free_list_ptr);
+   void *object = heapMalloc(n);
+   if (object == NULL) {
+      __atomic_fetch_add(&failed_allocs, 1, __ATOMIC_RELAXED);
+   }
+   if (trace != NULL) {
+      traceRecord(TRACE_MALLOC, n, object);
+   }
+   return object;
+}
 
-   // Trawler trawls through the free list to find ANY memory chunk
-   // that n would fit into.
-   free_header_t *trawler = whatAddress(free_list_ptr);
-   int teller = 0;
-   do {
-      if (trawler->size >= n + HEADER_SIZE) {
-         teller++;
-         break;
-      }
-      trawler = whatAddress(trawler->next);
-   } while (trawler != whatAddress(free_list_ptr));
 
-   // If no chunks are found that is big enough for n, return NULL.
-   if (teller == 0) { 
-      return NULL;
+// Input: object, a pointer.
+// Output: none
+// Precondition: object points to a location immediately after a header block
+//               within the allocator's memory.
+// Postcondition: The region pointed to by object can be re-allocated by 
+//                vlad_malloc
+
+void vlad_free(void *object)
+{
+   if (trace != NULL) {
+      traceRecord(TRACE_FREE, 0, object);
    }
+   heapFree(object);
+}
 
-         //printf("at least one chunk found!\n");
 
-   // Check if there is only one free chunk, and if so,
-   // if it can't be split before allocating n - (i.e. if it'll 
-   // result in no free chunks being available), return NULL.
-   if (trawler->next == whatIndex(trawler)  
-      && trawler->prev == whatIndex(trawler)
-      && trawler->size < 2*(n + HEADER_SIZE)) {
+// Input: object - a pointer, or NULL
+//        n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Precondition: object is NULL or was returned by vlad_malloc()
+// Postcondition: p points to a region of at least n bytes holding the
+//                first n bytes of object's region (or all of it, if it
+//                was smaller). The region is resized in place when it
+//                can be, and moved otherwise. If it cannot be resized,
+//                p = NULL and object is untouched. vlad_realloc(NULL, n)
+//                is vlad_malloc(n); vlad_realloc(object, 0) frees object
+//                and returns NULL.
+
+void *vlad_realloc(void *object, size_t n)
+{
+   if (object == NULL) {
+      return vlad_malloc(n);
+   }
+   if (n == 0) {
+      vlad_free(object);
       return NULL;
    }
 
-   // Trawler now trawls through the free list to find the smallest 
-   // memory chunk that n would fit into.
-
-   vsize_t minSize = trawler->size;
-   vaddr_t minIndex = whatIndex(trawler);
-
-   free_list_ptr = whatIndex(trawler);
+   // Once old is freed, another thread may be given it and trace that
+   // first, so the pair of slots is taken, side by side, before then.
+   u_int64_t slot = 0;
+   int tracing = (trace != NULL);
+   if (tracing) {
+      slot = __atomic_fetch_add(&trace->written, 2, __ATOMIC_RELAXED);
+   }
 
-   do {
-      if (trawler->size > n + HEADER_SIZE && trawler->size < minSize) {
-         minSize = trawler->size;
-         minIndex = whatIndex(trawler);
+   size_t size;
+   void *moved = heapResize(object, n, &size);
+   // Moving may land in any arena, just as a fresh vlad_malloc would.
+   if (moved == NULL) {
+      moved = heapMalloc(n);
+      if (moved != NULL) {
+         memcpy(moved, object, (size < n) ? size : n);
+         heapFree(object);
       }
-      trawler = whatAddress(trawler->next);
-   } while(trawler != whatAddress(free_list_ptr));
-
-         //printf("minSize is %d at %d\n", minSize, minIndex);
-
-
-   // Once smallest memory chunk is found, split it up until (sizeOK == TRUE)
-   ptr = whatAddress(minIndex);
-
-   free_header_t *newHeader = ptr;
-   newHeader->magic = newHeader->magic; // To keep compiler happy.
-
-   while (!sizeOK(ptr,n)) {   
-      newHeader = insertHalve(ptr);
    }
+   if (moved == NULL) {
+      __atomic_fetch_add(&failed_allocs, 1, __ATOMIC_RELAXED);
+   }
+   if (tracing) {
+      traceRealloc(slot, n, object, moved);
+   }
+   return moved;
+}
 
-   assert(sizeOK(ptr, n));
-         //printf("passed assert sizeOK!\n");
-
-      // Test printfs to show the chunk of memory to be allocated:
-         //printf("Memory is to be allocated at ptr.\n");
-         //printf("ptr is at %d\n", whatIndex(ptr));
-         //printf("ptr->size is %d\n", ptr->size);
-         //printf("ptr->next = %d\n", ptr->next);
-         //printf("ptr->prev = %d\n", ptr->prev);
 
+// Input: count - number of objects, size - bytes in each object
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_malloc(count * size), but every byte of
+//                the region is zero. Blocks that have not been written
+//                since the arena was set up are not cleared again.
 
-   // Ensure the block to be allocated is free:
-   if (!magicFreeOK(ptr)) {
-      fprintf(stderr, "Attempt to allocate non-free memory");
-      abort();
-   } 
+void *vlad_calloc(size_t count, size_t size)
+{
+   void *object = heapCalloc(count, size);
+   if (object == NULL) {
+      __atomic_fetch_add(&failed_allocs, 1, __ATOMIC_RELAXED);
+   }
+   if (trace != NULL) {
+      traceRecord(TRACE_MALLOC, count * size, object);
+   }
+   return object;
+}
 
-   // Set header magic to MAGIC_ALLOC
-   ptr->magic = MAGIC_ALLOC;
 
-   // Link the surrounding free blocks together, skipping
-   // over the current memory block to be allocated (ptr):
-   free_header_t *ptrNext = whatAddress(ptr->next);
-   free_header_t *ptrPrev = whatAddress(ptr->prev);
+// Input: alignment - a power of two, n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_malloc(n), but p is a multiple of
+//                alignment. p = NULL if alignment is not a power of two.
+//                The region can be freed and resized as any other, but
+//                a region that moves on resizing loses its alignment.
 
-      //printf("ptrNext is at %d\n", whatIndex(ptrNext));
-      //printf("ptrPrev is at %d\n", whatIndex(ptrPrev));
+void *vlad_memalign(size_t alignment, size_t n)
+{
+   void *object = heapMemalign(alignment, n);
+   if (object == NULL) {
+      __atomic_fetch_add(&failed_allocs, 1, __ATOMIC_RELAXED);
+   }
+   if (trace != NULL) {
+      traceRecord(TRACE_MALLOC, n, object);
+   }
+   return object;
+}
 
-   ptrNext->prev = ptr->prev; 
-   ptrPrev->next = whatIndex(ptrNext); 
 
-      //printf("1. ptrNext->prev = %d\n", ptrNext->prev);
-      //printf("2. ptrPrev->next = %d\n", ptrPrev->next);
+// Input: alignment - a power of two, n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_memalign(alignment, n)
 
+void *vlad_aligned_alloc(size_t alignment, size_t n)
+{
+   return vlad_memalign(alignment, n);
+}
 
-   // Set free_list_ptr to next header
-   free_list_ptr = ptr->next;
 
-      //printf("free_list_ptr now at: %d at %p\n", free_list_ptr, &memory[free_list_ptr]);
-      //printf("memory returned is at: %p\n", (void*)ptr + HEADER_SIZE);
-   
+// Input: object - a pointer
+// Output: 1 if object lies in memory vlad_malloc() and friends hand out
+//         from, else 0
 
-   return ((void*)ptr + HEADER_SIZE);
+int vlad_owns(void *object)
+{
+   if (whatOwner(object) != NULL) {
+      return 1;
+   }
+   pthread_rwlock_rdlock(&regions_lock);
+   int owned = (whatRegion(object) != NULL);
+   pthread_rwlock_unlock(&regions_lock);
+   return owned || whatHuge(object) != NULL;
 }
 
 
-// Input: object, a pointer.
-// Output: none
-// Precondition: object points to a location immediately after a header block
-//               within the allocator's memory.
-// Postcondition: The region pointed to by object can be re-allocated by 
-//                vlad_malloc
+// Input: object - a pointer
+// Precondition: object was returned by vlad_malloc() and friends
+// Output: the # bytes that can be used at object, at least as many as
+//         were asked for
 
-void vlad_free(void *object)
+size_t vlad_usable_size(void *object)
 {
-   free_header_t *ptr = (free_header_t *)(object - HEADER_SIZE);
-
-   // Check that block to be freed is valid:
-   if (!magicAllocOK(ptr)) {
-      fprintf(stderr, "Attempt to free non-allocated memory");
-      abort();
-   } 
+   arena_t *a = whatOwner(object);
+   int inRegion = (a == NULL);
+   if (inRegion) {
+      pthread_rwlock_rdlock(&regions_lock);
+      a = whatRegion(object);
+   }
+   if (a == NULL) {
+      pthread_rwlock_unlock(&regions_lock);
+      huge_header_t *h = whatHuge(object);
+      return (h == NULL) ? 0 : h->size - h->offset;
+   }
+   pthread_mutex_lock(&a->lock);
+   size_t size = whatUsableSize(a, object);
+   pthread_mutex_unlock(&a->lock);
+   if (inRegion) {
+      pthread_rwlock_unlock(&regions_lock);
+   }
+   return size;
+}
 
-   // Set header magic to free:
-   ptr->magic = MAGIC_FREE;
 
-   // Find highest and lowest indices/positions in the free list:
-   free_header_t *trawler = (free_header_t *)(memory + free_list_ptr);
-   
-   vaddr_t min = free_list_ptr;
-   vaddr_t max = free_list_ptr;
+// Input: n - number of bytes in each object
+//        count - number of objects requested
+//        objects - array of at least count pointers
+// Output: the number of objects allocated, at most count
+// Postcondition: objects[0 .. result-1] are as if each came from
+//                vlad_malloc(n); fewer than count means memory ran out.
+//                Carving many blocks at once is cheaper than count calls.
 
-   do {
-      if (whatIndex(trawler) < min) {
-         min = whatIndex(trawler);
-      }
-      if (whatIndex(trawler) > max) {
-         max = whatIndex(trawler);
+int vlad_malloc_batch(size_t n, int count, void **objects)
+{
+   arena_t *home = whatArena();
+   int done = 0;
+   int i;
+   for (i = 0; i < n_arenas && done < count && !isHugeSize(n); i++) {
+      arena_t *a = &arenas[(home - arenas + i) % n_arenas];
+      done += vlad_arena_malloc_batch(a, n, count - done, objects + done);
+   }
+   while (done < count
+      && (objects[done] = heapMalloc(n)) != NULL) {
+      done++;
+   }
+   if (done < count) {
+      __atomic_fetch_add(&failed_allocs, count - done, __ATOMIC_RELAXED);
+   }
+   if (trace != NULL) {
+      for (i = 0; i < done; i++) {
+         traceRecord(TRACE_MALLOC, n, objects[i]);
       }
-      trawler = whatAddress(trawler->next);
-
-   } while (trawler != whatAddress(free_list_ptr));
+   }
+   return done;
+}
 
-         //printf("min is at: %d\n", min); 
 
+// Input: objects - array of pointers, count - number of them
+// Precondition: each object was returned by vlad_malloc() and friends
+// Postcondition: every object is freed, as by vlad_free(). Neighbouring
+//                blocks in the batch are merged with each other first.
+//                The contents of objects[] are left unspecified.
 
-   // Declare pointers for headers above and below 
-   // the newly-freed-block in free list:
-   free_header_t *ptrPrev = NULL;
-   free_header_t *ptrNext = NULL;
+void vlad_free_batch(void **objects, int count)
+{
+   int start;
+   if (trace != NULL) {
+      for (start = 0; start < count; start++) {
+         traceRecord(TRACE_FREE, 0, objects[start]);
+      }
+   }
 
-   // Now find the correct position for newly freed block:
-   if (whatIndex(ptr) < min || whatIndex(ptr) > max) {
-      ptrPrev = whatAddress(max);
-      ptrNext = whatAddress(min);
-      if (whatIndex(ptr) < min) {
-         min = whatIndex(ptr);
+   // The arenas and regions lie in address order, so after sorting, each
+   // one's objects form one run that can be freed under one lock.
+   qsort(objects, count, sizeof(void *), compareAddress);
+   int inRegions = 0;
+   start = 0;
+   while (start < count) {
+      arena_t *a = whatOwner(objects[start]);
+      if (a == NULL) {
+         if (!inRegions) {
+            pthread_rwlock_rdlock(&regions_lock);
+            inRegions = 1;
+         }
+         a = whatRegion(objects[start]);
       }
-   } else {
-      trawler = whatAddress(min);
-      do {
-         if (whatIndex(trawler) < whatIndex(ptr) 
-            && trawler->next > whatIndex(ptr)) {
-            ptrPrev = trawler;
-            ptrNext = whatAddress(trawler->next);
-            break;
+      if (a == NULL) {
+         huge_header_t *h = whatHuge(objects[start]);
+         if (h == NULL) {
+            fprintf(stderr, "Attempt to free non-allocated memory");
+            abort();
          }
-         trawler = whatAddress(trawler->next);
-      } while (trawler != whatAddress(min));
+         hugeFree(h);
+         start++;
+         continue;
+      }
+      int end = start + 1;
+      while (end < count && (whatOwner(objects[end]) == a
+         || (inRegions && whatRegion(objects[end]) == a))) {
+         end++;
+      }
+      pthread_mutex_lock(&a->lock);
+      arenaFreeBatch(a, objects + start, end - start);
+      pthread_mutex_unlock(&a->lock);
+      start = end;
    }
+   if (inRegions) {
+      pthread_rwlock_unlock(&regions_lock);
+      releaseRegions();
+   }
+}
 
-         //printf("now min is at: %d\n", min);
 
-      // Test printfs to show the chunk of memory to be freed:
-         //printf("ptr is at %d\n", whatIndex(ptr));
-         //printf("ptrNext is at %d\n", whatIndex(ptrNext));
-         //printf("ptrPrev is at %d\n", whatIndex(ptrPrev));
+// Output: the # bytes given back to the OS
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: every free block of 64KB or more in the heap has had
+//                its pages given back to the OS but the first, as have
+//                all free regions but one
+//
+// Blocks left free for a second are given back anyway, as the arena
+// they are in goes on being used; this does it for all of them now,
+// e.g. once a burst of allocation is over. The pages come back, zero,
+// when next touched.
 
-   // Assign prev and next of newly-freed-block to surrounding headers
-   assert(ptrPrev != NULL && ptrNext != NULL);
-   ptr->next = whatIndex(ptrNext);
-   ptr->prev = whatIndex(ptrPrev);
+size_t vlad_purge(void)
+{
+   size_t purged = 0;
+   pthread_rwlock_rdlock(&regions_lock);
+   int i;
+   for (i = 0; i < n_arenas + n_regions; i++) {
+      arena_t *a = (i < n_arenas) ? &arenas[i] : regions[i - n_arenas];
+      pthread_mutex_lock(&a->lock);
+      purged += arenaPurge(a);
+      pthread_mutex_unlock(&a->lock);
+   }
+   pthread_rwlock_unlock(&regions_lock);
+   releaseRegions();
+   return purged;
+}
 
-   // Adjust next/prev of blocks above and below newly-freed-block
-   // to link it to the rest of the list
-   ptrNext->prev = whatIndex(ptr);
-   ptrPrev->next = whatIndex(ptr);
 
-         //printf("Now ptrNext->prev is %d\n", ptrNext->prev);
-         //printf("Now ptrPrev->next is %d\n", ptrPrev->next);
+// Precondition: allocator has been vlad_init()'d, and no other thread
+//               is using it
+// Postcondition: every arena is one free block again, as vlad_init()
+//                left it, every region is given back to the OS but one,
+//                which is emptied too, and every huge block is unmapped;
+//                everything allocated is gone
+//
+// Each arena is reset by rewriting its root header and clearing its
+// bookkeeping, without visiting the blocks that were in it, so this
+// takes the same time however many there were. The memory is not given
+// back to the OS.
 
+void vlad_reset(void)
+{
+   pthread_rwlock_rdlock(&regions_lock);
+   int i;
+   for (i = 0; i < n_arenas + n_regions; i++) {
+      arena_t *a = (i < n_arenas) ? &arenas[i] : regions[i - n_arenas];
+      pthread_mutex_lock(&a->lock);
+      arenaFormat(a, 0);
+      pthread_mutex_unlock(&a->lock);
+   }
+   pthread_rwlock_unlock(&regions_lock);
+   releaseRegions();
+   releaseHuge();
+}
 
-   // End of freeing, now to merge..
 
+// Output: mark - a mark, or NULL
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: as for vlad_arena_mark(), on the arena the calling
+//                thread allocates from
+//
+// Huge blocks, and blocks the thread gets from a region once its own
+// arena is full, are not covered by the mark; blocks other threads
+// sharing the arena get from it are, and a rewind frees them under
+// those threads' feet. So this is only safe with no more threads than
+// arenas. While it is set, small requests skip the slabs.
 
+vlad_mark_t *vlad_mark(void)
+{
+   if (memory == NULL) {
+      return NULL;
+   }
+   return vlad_arena_mark(whatArena());
+}
 
-   // Merging begins here:
 
-   // The trawling will begin from lowest-positioned block of free memory.
-   free_list_ptr = min;
-   trawler = whatAddress(free_list_ptr);
+// Input: mark - a mark returned by vlad_mark()
+// Postcondition: as for vlad_arena_rewind(), on the arena mark was set in
 
-   // Bullion hasMerged to check if a merge has occured within the inner loop.
-   // If it goes through inner loop without any merges, the outer loop exits.
-   int hasMerged = 1;
-   do {
-      hasMerged = 0;
-      do {
-         //printf("Checking mergability at %d with %d, size is:%d\n", whatIndex(trawler), trawler->next, trawler->size);
-         if(canMergeNext(trawler)) {
-            merge_with_next(trawler);
-            //printf("Merged at %d with %d, size is:%d\n", whatIndex(trawler), trawler->next, trawler->size);
-            hasMerged = 1;
-         }
-         trawler = whatAddress(trawler->next);
-      } while (trawler != whatAddress(free_list_ptr));
-   }  while (hasMerged);
-   
+void vlad_rewind(vlad_mark_t *mark)
+{
+   arena_t *a = whatOwner(mark);
+   if (a == NULL) {
+      fprintf(stderr, "Attempt to rewind to a mark not set");
+      abort();
+   }
+   vlad_arena_rewind(a, mark);
 }
 
 
@@ -356,171 +1077,2660 @@ void vlad_free(void *object)
 
 void vlad_end(void)
 {
-   free(memory);
+   vlad_trace_stop();   // offsets in it only make sense for this heap
+   int i;
+   for (i = 0; i < n_arenas; i++) {
+      arenaEnd(&arenas[i]);
+   }
+   for (i = 0; i < n_regions; i++) {
+      vlad_arena_destroy(regions[i]);
+   }
+   releaseHuge();
+   if (regions != NULL) {
+      munmap(regions, max_regions * sizeof(arena_t *));
+   }
+   regions = NULL;
+   n_regions = max_regions = 0;
+   failed_allocs = 0;
+   munmap(arenas, n_arenas * sizeof(arena_t));
+   munmap(memory, (size_t)n_arenas * memory_size);
+   arenas = NULL;
+   memory = NULL;
+   n_arenas = 0;
 }
 
 
+// Input: stats - where to put the figures
 // Precondition: allocator has been vlad_init()'d
-// Postcondition: allocator stats displayed on stdout
+// Postcondition: *stats describes the heap as it is now (each arena and
+//                region as of when it was looked at), and what it has
+//                done since vlad_init()
+//
+// Every figure is a counter kept as blocks come and go, so this takes
+// time in proportion to the number of orders, not of blocks.
 
-void vlad_stats(void)
+void vlad_get_stats(struct vlad_stats *stats)
 {
-   // This simply prints out all of the free blocks of memory in
-   // the free list and lists their details/nodes.
-
-   free_header_t *ptr = (free_header_t *)(memory + free_list_ptr);
-   ptr = whatAddress(ptr->next);
-
-   printf("-----------------------\n");
-   printf("free_list_ptr at [%d]\n", free_list_ptr);
-   printf("-----------------------\n");
-   while (ptr != (free_header_t *)(memory + free_list_ptr)) {
-      printf("Free Slot at [%d]\n", whatIndex(ptr));
-      printf("  size = %d\n", ptr->size);
-      printf("  next = %d\n", ptr->next);
-      printf("  prev = %d\n", ptr->prev);
-      //printf("\n");
-      printf("-----------------------\n");
-      //printf("\n");
-      ptr = (free_header_t *)(memory + ptr->next);
+   memset(stats, 0, sizeof(*stats));
+   pthread_rwlock_rdlock(&regions_lock);
+   int i;
+   for (i = 0; i < n_arenas + n_regions; i++) {
+      arena_t *a = (i < n_arenas) ? &arenas[i] : regions[i - n_arenas];
+      pthread_mutex_lock(&a->lock);
+      drainRemote(a);   // so that what is queued counts as free
+      stats->heap_bytes += a->memory_size;
+      u_int32_t order;
+      for (order = 0; order < MAX_ORDERS; order++) {
+         stats->free_blocks[order] += a->free_counts[order];
+         stats->free_bytes += a->free_counts[order] * whatSize(order);
+      }
+      // Blocks on quick lists are free, if not yet merged.
+      for (order = 0; order <= QUICK_MAX_ORDER; order++) {
+         stats->free_blocks[order] += a->quick_counts[order];
+         stats->free_bytes += a->quick_counts[order] * whatSize(order);
+      }
+      u_int64_t orders = a->free_orders | a->quick_orders;
+      if (orders != 0) {
+         size_t largest = whatSize(63 - __builtin_clzll(orders));
+         if (largest > stats->largest_free) {
+            stats->largest_free = largest;
+         }
+      }
+      stats->used_objects += a->live;
+      stats->splits += a->splits;
+      stats->merges += a->merges;
+      stats->requested += a->requested;
+      stats->granted += a->granted;
+      stats->purged += a->purged;
+      pthread_mutex_unlock(&a->lock);
+   }
+   pthread_rwlock_unlock(&regions_lock);
+   pthread_mutex_lock(&huge_lock);
+   stats->huge_bytes = huge_bytes;
+   stats->heap_bytes += huge_bytes;
+   stats->used_objects += huge_count;
+   pthread_mutex_unlock(&huge_lock);
+
+   stats->used_bytes = stats->heap_bytes - stats->free_bytes;
+   stats->failed = __atomic_load_n(&failed_allocs, __ATOMIC_RELAXED);
+   if (stats->granted != 0) {
+      stats->internal_frag = 1.0 - (double)stats->requested / stats->granted;
    }
+   if (stats->free_bytes != 0) {
+      stats->external_frag =
+         1.0 - (double)stats->largest_free / stats->free_bytes;
+   }
+}
 
-   printf("Last Free Slot at [%d]\n", free_list_ptr);
-   printf("  size = %d\n", ptr->size);
-   printf("  next = %d\n", ptr->next);
-   printf("  prev = %d\n", ptr->prev);
-   printf("-----------------------\n");
 
-   return;
+// Input: path - file to record into, records - # records to keep
+// Output: 0, or -1 if the file cannot be set up
+// Precondition: no other thread is using the allocator
+// Postcondition: from now until vlad_trace_stop(), each call of
+//                vlad_malloc(), vlad_free() and the like is recorded in
+//                path, which is created or emptied. Only the latest
+//                `records` records are kept (see trace.h for the format).
+
+int vlad_trace_start(const char *path, size_t records)
+{
+   vlad_trace_stop();
+   if (records == 0) {
+      return -1;
+   }
+   size_t total = sizeof(trace_header_t) + records * sizeof(trace_record_t);
+   int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      return -1;
+   }
+   void *file = MAP_FAILED;
+   if (ftruncate(fd, total) == 0) {
+      file = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   }
+   close(fd);
+   if (file == MAP_FAILED) {
+      return -1;
+   }
+
+   trace_header_t *header = file;
+   header->magic = TRACE_MAGIC;
+   header->version = TRACE_VERSION;
+   header->capacity = records;
+   header->written = 0;
+   trace_ring = (trace_record_t *)(header + 1);
+   trace = header;
+   return 0;
 }
 
 
-// Miscellaneous functions below:
+// Precondition: no other thread is using the allocator
+// Postcondition: recording started by vlad_trace_start() is finished,
+//                and its file complete
 
-// Function to test if x is a power of two.
-int isPowerOfTwo (u_int32_t x) {
-  return ((x != 0) && !(x & (x - 1)));
+void vlad_trace_stop(void)
+{
+   if (trace == NULL) {
+      return;
+   }
+   size_t total = sizeof(trace_header_t)
+      + trace->capacity * sizeof(trace_record_t);
+   munmap(trace, total);
+   trace = NULL;
+   trace_ring = NULL;
 }
 
-// Function that takes in an integer and returns 
-// the closest power of two that is higher than it.
-u_int32_t whatPowerUp(int n) {
-   int power = 0;
-   double f = n;
-      while (f > 1) {
-         f = f / 2;
-         power++;
+
+// Input: fd - a file descriptor open for writing
+// Output: 0, or -1 if writing failed
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: a map of every block of every arena and region, in the
+//                format of snapshot.h, has been written to fd
+//
+// Each arena is walked a few thousand blocks at a time, with its lock
+// held for just that chunk and none held while writing, so a heap of
+// any size can be mapped while in use.
+
+int vlad_snapshot(int fd)
+{
+   snapshot_header_t header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION,
+                               HEADER_SIZE, MIN_ORDER};
+   if (writeAll(fd, &header, sizeof(header)) < 0) {
+      return -1;
+   }
+   int i;
+   for (i = 0; i < n_arenas; i++) {
+      if (snapshotArena(&arenas[i], NULL, fd) < 0) {
+         return -1;
+      }
+   }
+   // Regions may come and go meanwhile, so each is found as the first
+   // one after the last, in address order.
+   byte *last = NULL;
+   for (;;) {
+      byte *next = NULL;
+      pthread_rwlock_rdlock(&regions_lock);
+      for (i = 0; i < n_regions && next == NULL; i++) {
+         if (regions[i]->memory > last) {
+            next = regions[i]->memory;
+         }
+      }
+      pthread_rwlock_unlock(&regions_lock);
+      if (next == NULL) {
+         break;
+      }
+      if (snapshotArena(NULL, next, fd) < 0) {
+         return -1;
       }
-   int result = 1;
-   while (power != 0) {
-      result = result*2;
-      power--;
+      last = next;
    }
-   return result;
+   snapshot_arena_t end = {0, 0, 0, 0};
+   return writeAll(fd, &end, sizeof(end));
 }
 
-// Function that returns the memory[] index of a given pointer to a header.
-vlink_t whatIndex(free_header_t *ptr) {
-   vlink_t index = (vlink_t)((byte*)ptr - memory);
-   return index;
-}
 
-// Function that return the address of a given memory[] index.
-free_header_t *whatAddress(vaddr_t index) {
-   free_header_t *ptr = (free_header_t *)(memory + index);
-   return ptr;
-}
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: allocator stats displayed on stdout
 
-// Function that splits the block of memory ptr is pointing to
-// into two equal-sized blocks, returning a pointer to the new block
-// at the halfway point.
-free_header_t *insertHalve(free_header_t *ptr) {
+void vlad_stats(void)
+{
+   // This simply prints out all of the free blocks of memory in
+   // each order's free list and lists their details/nodes.
 
-   free_header_t *newHeader = (free_header_t*)((byte*)ptr+(ptr->size/2));
+   pthread_rwlock_rdlock(&regions_lock);
+   int i;
+   for (i = 0; i < n_arenas + n_regions; i++) {
+      arena_t *a = (i < n_arenas) ? &arenas[i] : regions[i - n_arenas];
+      pthread_mutex_lock(&a->lock);
+      drainRemote(a);
+      flushQuick(a);   // so that every free block is on a free list
 
-   newHeader->magic = MAGIC_FREE;
-   newHeader->size = ptr->size/2;
-   newHeader->next = ptr->next;
-   newHeader->prev = whatIndex(ptr);
+      printf("-----------------------\n");
+      printf("%s %d: free_orders = 0x%016llx\n",
+         (i < n_arenas) ? "arena" : "region",
+         (i < n_arenas) ? i : i - n_arenas,
+         (unsigned long long)a->free_orders);
+      printf("-----------------------\n");
 
-         //printf("newHeader size is: %d at %p\n", newHeader->size, newHeader);
+      u_int32_t order;
+      for (order = 0; order < MAX_ORDERS; order++) {
+         if (!(a->free_orders & (1ull << order))) {
+            continue;
+         }
+         printf("Order %d (%lu bytes), list at [%lu]\n", order,
+            (unsigned long)whatSize(order),
+            (unsigned long)a->free_lists[order]);
+         printf("-----------------------\n");
+         free_header_t *ptr = whatAddress(a, a->free_lists[order]);
+         do {
+            printf("Free Slot at [%lu]\n", (unsigned long)whatIndex(a, ptr));
+            printf("  size = %lu\n", (unsigned long)ptr->size);
+            printf("  next = %lu\n", (unsigned long)ptr->next);
+            printf("  prev = %lu\n", (unsigned long)ptr->prev);
+            printf("-----------------------\n");
+            ptr = whatAddress(a, ptr->next);
+         } while (ptr != whatAddress(a, a->free_lists[order]));
+      }
 
-   // Reassign ptr header variables:
-   ptr->size = ptr->size/2;
-   if (ptr->next == whatIndex(ptr) && ptr->prev == whatIndex(ptr)) {
-      ptr->prev = whatIndex(newHeader);
-      ptr->next = whatIndex(newHeader);
-   } else {
-      free_header_t *headerAfter = whatAddress(newHeader->next);
-      headerAfter->prev = whatIndex(newHeader);
-      ptr->next = whatIndex(newHeader);
+      pthread_mutex_unlock(&a->lock);
    }
+   pthread_rwlock_unlock(&regions_lock);
+
+   return;
+}
 
-   return newHeader;
 
+// Input: size - number of bytes to make available to the arena
+// Output: a - a new arena, or NULL if its memory cannot be obtained
+// Precondition: Size is a power of two.
+// Postcondition: `size` bytes are available to vlad_arena_malloc(a, ...)
+
+vlad_arena_t *vlad_arena_create(size_t size)
+{
+   return vlad_arena_create_flags(size, 0);
 }
 
-// Function that ensures that new block to be allocated 
-// is correct size for allocating n bytes
-int sizeOK (free_header_t *header, u_int32_t n) {
-   return ((header->size >= HEADER_SIZE + n 
-      && header->size/2 < HEADER_SIZE + n));
+
+// Input: size - number of bytes to make available to the arena
+//        flags - VLAD_* flags, or'ed together
+// Output: a - a new arena, or NULL if its memory cannot be obtained
+// Precondition: Size is a power of two.
+// Postcondition: `size` bytes are available to vlad_arena_malloc(a, ...)
+
+vlad_arena_t *vlad_arena_create_flags(size_t size, int flags)
+{
+   if (size > whatSize(MAX_ORDERS - 1)) {
+      return NULL;
+   }
+   if (!isPowerOfTwo(size)) {
+      size = whatPowerUp(size);
+   }
+   if (size < HEADER_SIZE) {
+      size = HEADER_SIZE;
+   }
+
+   arena_t *a = mapMemory(sizeof(arena_t), 0, 0);
+   if (a == NULL) {
+      return NULL;
+   }
+   byte *mem = mapMemory(size, size, flags);
+   if (mem == NULL) {
+      munmap(a, sizeof(arena_t));
+      return NULL;
+   }
+   if (arenaInit(a, mem, size, flags) < 0) {
+      munmap(mem, size);
+      munmap(a, sizeof(arena_t));
+      return NULL;
+   }
+   return a;
 }
 
-// Determines if memory block is a valid FREE block;
-int magicFreeOK(free_header_t *header) {
-   return (header->magic == MAGIC_FREE);
+
+// Input: a - an arena, n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_malloc, but p lies in a's memory
+
+void *vlad_arena_malloc(vlad_arena_t *a, size_t n)
+{
+   pthread_mutex_lock(&a->lock);
+   void *object = arenaMalloc(a, n);
+   pthread_mutex_unlock(&a->lock);
+   return object;
 }
 
-// Determines if memory block is a valid ALLOCATED block;
-int magicAllocOK(free_header_t *header) {
-   return (header->magic == MAGIC_ALLOC);
-}
-
-// Determines if a block of memory pointed to by ptr
-// can be merged with the block NEXT to it.
-int canMergeNext(free_header_t *ptr) {
-   if ( (whatIndex(ptr) == 0 || wasSplit(whatIndex(ptr), ptr->size))
-      && (whatAddress(ptr->next)->size == ptr->size)
-      && (ptr->next - whatIndex(ptr) == ptr->size)) {
-            //printf("canMergeNext successful\n");
-            //printf("ptr->next is %d\n", ptr->next);
-            //printf("ptr is at %d\n", whatIndex(ptr));
-            //printf("ptr->size is %d\n", ptr->size);
-         return 1;
-      } else {
-      return 0;
+
+// Input: a - an arena, n - number of bytes requested, order - log2 of
+//        the smallest power of two of at least n + VLAD_HEADER_SIZE
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_arena_malloc(a, n)
+
+void *vlad_arena_malloc_order(vlad_arena_t *a, size_t n, unsigned order)
+{
+   // Without headers, n may fit a block of an order less. An order that
+   // is not n's (say from a caller built with other VLAD_SMALL_HEADERS)
+   // is not trusted either; checking it costs no more than a compare.
+   if (whatHeaderSize(a) == 0 || n > a->memory_size - HEADER_SIZE
+      || order <= MIN_ORDER || order >= MAX_ORDERS
+      || whatSize(order) < n + HEADER_SIZE
+      || whatSize(order - 1) >= n + HEADER_SIZE) {
+      return vlad_arena_malloc(a, n);
    }
+   pthread_mutex_lock(&a->lock);
+   void *object = arenaMallocOrder(a, n, order);
+   pthread_mutex_unlock(&a->lock);
+   return object;
 }
 
-// Determines if a block of memory at index with size = size was
-// split from the region consisting it and the block NEXT to it.
-int wasSplit(vlink_t index, vsize_t size) {
 
-   // Checks if index is a multiple of 2*size:
-   vsize_t increment = 2*size;
+// Input: a - an arena, object - a pointer
+// Precondition: object was returned by vlad_arena_malloc(a, ...)
+// Postcondition: The region pointed to by object can be re-allocated by 
+//                vlad_arena_malloc(a, ...)
 
-   vaddr_t i = 0;
-   while (i != memory_size) {
-      if (index == i) {
-         return 1;
-      }
-      i += increment;
-   }
-   return 0;
+void vlad_arena_free(vlad_arena_t *a, void *object)
+{
+   pthread_mutex_lock(&a->lock);
+   arenaFree(a, object);
+   pthread_mutex_unlock(&a->lock);
 }
 
-// Merges the block of memory with the block NEXT to it.
-void merge_with_next(free_header_t *ptr) {
 
-   if (free_list_ptr == ptr->next) {
-      free_list_ptr = whatIndex(ptr);
-   }
+// Input: a - an arena, n - number of bytes in each object
+//        count - number of objects requested
+//        objects - array of at least count pointers
+// Output: the number of objects allocated, at most count
+// Postcondition: as for vlad_malloc_batch(), but in a's memory
+
+int vlad_arena_malloc_batch(vlad_arena_t *a, size_t n, int count,
+                            void **objects)
+{
+   pthread_mutex_lock(&a->lock);
+   int done = arenaMallocBatch(a, n, count, objects);
+   pthread_mutex_unlock(&a->lock);
+   return done;
+}
 
-   ptr->next = whatAddress(ptr->next)->next;
-   whatAddress(ptr->next)->prev = whatIndex(ptr);
 
-   ptr->size = (ptr->size)*2;
+// Input: a - an arena, objects - array of pointers, count - how many
+// Precondition: each object was returned by vlad_arena_malloc(a, ...)
+// Postcondition: as for vlad_free_batch()
+
+void vlad_arena_free_batch(vlad_arena_t *a, void **objects, int count)
+{
+   qsort(objects, count, sizeof(void *), compareAddress);
+   pthread_mutex_lock(&a->lock);
+   arenaFreeBatch(a, objects, count);
+   pthread_mutex_unlock(&a->lock);
+}
+
+
+// Input: a - an arena, n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_arena_malloc, but every byte of p is zero
+
+void *vlad_arena_calloc(vlad_arena_t *a, size_t n)
+{
+   pthread_mutex_lock(&a->lock);
+   void *object = arenaCalloc(a, n);
+   pthread_mutex_unlock(&a->lock);
+   return object;
+}
+
+
+// Input: a - an arena, alignment - a power of two
+//        n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_memalign, but p lies in a's memory
+
+void *vlad_arena_memalign(vlad_arena_t *a, size_t alignment, size_t n)
+{
+   if (!isPowerOfTwo(alignment)) {
+      return NULL;
+   }
+   pthread_mutex_lock(&a->lock);
+   void *object = arenaMemalign(a, alignment, n);
+   pthread_mutex_unlock(&a->lock);
+   return object;
+}
+
+
+// Input: a - an arena, object - a pointer, or NULL
+//        n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Precondition: object is NULL or was returned by vlad_arena_malloc(a, ...)
+// Postcondition: as for vlad_realloc, but p lies in a's memory
+
+void *vlad_arena_realloc(vlad_arena_t *a, void *object, size_t n)
+{
+   if (object == NULL) {
+      return vlad_arena_malloc(a, n);
+   }
+   if (n == 0) {
+      vlad_arena_free(a, object);
+      return NULL;
+   }
+
+   pthread_mutex_lock(&a->lock);
+   void *moved = object;
+   if (!arenaResize(a, object, n)) {
+      size_t size = whatUsableSize(a, object);
+      moved = arenaMalloc(a, n);
+      if (moved != NULL) {
+         memcpy(moved, object, (size < n) ? size : n);
+         arenaFree(a, object);
+      }
+   }
+   pthread_mutex_unlock(&a->lock);
+   return moved;
+}
+
+
+// Input: a - an arena
+// Precondition: no other thread is using a
+// Postcondition: a is one free block again, as vlad_arena_create() left
+//                it; everything allocated from it is gone
+//
+// This takes the same time however many blocks were in a: only its root
+// header and bookkeeping are rewritten.
+
+void vlad_arena_reset(vlad_arena_t *a)
+{
+   pthread_mutex_lock(&a->lock);
+   arenaFormat(a, 0);
+   if (a->persist != NULL) {
+      a->persist->root = PERSIST_NO_ROOT;
+   }
+   pthread_mutex_unlock(&a->lock);
+}
+
+
+// Input: a - an arena
+// Output: the # bytes given back to the OS
+// Postcondition: as for vlad_purge(), but of a alone (and nothing, if a
+//                is persistent)
+
+size_t vlad_arena_purge(vlad_arena_t *a)
+{
+   pthread_mutex_lock(&a->lock);
+   size_t purged = arenaPurge(a);
+   pthread_mutex_unlock(&a->lock);
+   return purged;
+}
+
+
+// Input: a - an arena
+// Output: mark - a mark, or NULL if a has no room for one or is
+//         persistent or VLAD_NO_HEADERS
+// Postcondition: vlad_arena_rewind(a, mark) will free every block
+//                allocated from a after this, and not yet freed
+//
+// Marks nest: one set while another is would be rewound to first. While
+// any is set, every block allocated from a costs a few more stores to
+// keep in allocation order, and requests slabs would serve get blocks
+// of their own instead.
+
+vlad_mark_t *vlad_arena_mark(vlad_arena_t *a)
+{
+   pthread_mutex_lock(&a->lock);
+   free_header_t *mark = arenaMark(a);
+   pthread_mutex_unlock(&a->lock);
+   return (vlad_mark_t *)mark;
+}
+
+
+// Input: a - an arena, mark - a mark
+// Precondition: mark was returned by vlad_arena_mark(a) and has not been
+//               rewound to, nor a mark set before it
+// Postcondition: every block allocated from a since mark was set is
+//                freed, as by vlad_arena_free(); so are mark and any
+//                marks set after it, which cannot be used again
+//
+// The blocks are found without searching, from a list kept since the
+// mark, and freed in address-ordered batches, so neighbours merge with
+// each other before they reach the free lists.
+
+void vlad_arena_rewind(vlad_arena_t *a, vlad_mark_t *mark)
+{
+   pthread_mutex_lock(&a->lock);
+   arenaRewind(a, (free_header_t *)mark);
+   pthread_mutex_unlock(&a->lock);
+}
+
+
+// Input: a - an arena
+// Precondition: a was returned by vlad_arena_create()
+// Postcondition: a and every block still allocated from it are gone
+//                (a persistent arena is closed, as by
+//                vlad_close_persistent(), and its file kept)
+
+void vlad_arena_destroy(vlad_arena_t *a)
+{
+   if (a->persist != NULL) {
+      vlad_close_persistent(a);
+      return;
+   }
+   arenaEnd(a);
+   munmap(a->memory, a->memory_size);
+   munmap(a, sizeof(arena_t));
+}
+
+
+// Input: path - file to keep the arena in
+//        size - number of bytes to make available, for a new file
+// Output: a - the arena, or NULL if the file cannot be used
+// Postcondition: If path is new or empty, it now holds an empty arena of
+//                `size` bytes (rounded up to a power of two). Otherwise
+//                the arena already in it is reattached as it was left,
+//                with every allocation still in place, and size is
+//                ignored. If the file was not closed cleanly the arena
+//                in it cannot be trusted, so it is emptied instead.
+//
+// The file is mapped, not read, so reattaching takes constant time and
+// pages are only read in as they are used. The mapping may land at a
+// different address each time, so data in the arena should refer to
+// other data in it by offset from the root (see vlad_set_root()).
+// Files are only compatible between builds with the same header size.
+
+vlad_arena_t *vlad_open_persistent(const char *path, size_t size)
+{
+   int fd = open(path, O_RDWR | O_CREAT, 0600);
+   if (fd < 0) {
+      return NULL;
+   }
+   struct stat st;
+   if (fstat(fd, &st) < 0) {
+      close(fd);
+      return NULL;
+   }
+
+   // A new file gets a header for an empty arena; anything else must
+   // have been written by a compatible build.
+   persist_header_t header;
+   int fresh = (st.st_size == 0);
+   if (fresh) {
+      if (size > whatSize(MAX_ORDERS - 1)) {
+         close(fd);
+         return NULL;
+      }
+      if (!isPowerOfTwo(size)) {
+         size = whatPowerUp(size);
+      }
+      if (size < HEADER_SIZE) {
+         size = HEADER_SIZE;
+      }
+      memset(&header, 0, sizeof(header));
+      header.memory_size = size;
+      if (ftruncate(fd, whatPersistLayout(size, NULL, NULL, NULL)) < 0) {
+         close(fd);
+         return NULL;
+      }
+   } else if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+      || header.magic != PERSIST_MAGIC
+      || header.version != PERSIST_VERSION
+      || header.header_size != HEADER_SIZE
+      || header.memory_size > whatSize(MAX_ORDERS - 1)
+      || (size_t)st.st_size
+         < whatPersistLayout(header.memory_size, NULL, NULL, NULL)) {
+      close(fd);
+      return NULL;
+   }
+
+   size_t metaAt, slabAt, memAt;
+   size_t total = whatPersistLayout(header.memory_size,
+                                    &metaAt, &slabAt, &memAt);
+   // The heap goes on a multiple of its size, as in any other arena.
+   byte *file = reserveAligned(total, header.memory_size, memAt);
+   if (file == NULL || mmap(file, total, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_NORESERVE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      if (file != NULL) {
+         munmap(file, total);
+      }
+      close(fd);
+      return NULL;
+   }
+   close(fd);
+
+   arena_t *a = mapMemory(sizeof(arena_t), 0, 0);
+   if (a == NULL) {
+      munmap(file, total);
+      return NULL;
+   }
+   a->memory = file + memAt;
+   a->memory_size = header.memory_size;
+   a->block_meta = file + metaAt;
+   a->slab_pages = NULL;
+   if (a->memory_size >= SLAB_MIN_ARENA) {
+      a->slab_pages = (u_int64_t *)(file + slabAt);
+   }
+   a->persist = (persist_header_t *)file;
+   pthread_mutex_init(&a->lock, NULL);
+
+   if (fresh || !a->persist->clean) {
+      // An unclean file's heap may be half-updated: start it afresh.
+      a->flags = 0;
+      arenaFormat(a, fresh);
+      a->persist->magic = PERSIST_MAGIC;
+      a->persist->version = PERSIST_VERSION;
+      a->persist->header_size = HEADER_SIZE;
+      a->persist->memory_size = a->memory_size;
+      a->persist->root = PERSIST_NO_ROOT;
+   } else {
+      a->flags = a->persist->flags;
+      persistLoad(a);
+   }
+
+   // Until it is closed again, the file is not in a state to reattach.
+   a->persist->clean = 0;
+   msync(file, PAGE_SIZE_MIN, MS_SYNC);
+   return a;
+}
+
+
+// Input: a - an arena
+// Precondition: a was returned by vlad_open_persistent()
+// Postcondition: a's state is written back and marked clean in its file,
+//                which stays as it is for the next vlad_open_persistent()
+
+void vlad_close_persistent(vlad_arena_t *a)
+{
+   pthread_mutex_lock(&a->lock);
+   persistSave(a);
+   a->persist->flags = a->flags;
+   size_t total = whatPersistLayout(a->memory_size, NULL, NULL, NULL);
+   msync(a->persist, total, MS_SYNC);
+   a->persist->clean = 1;
+   msync(a->persist, PAGE_SIZE_MIN, MS_SYNC);
+   pthread_mutex_unlock(&a->lock);
+
+   arenaEnd(a);
+   munmap(a->persist, total);
+   munmap(a, sizeof(arena_t));
+}
+
+
+// Input: a - a persistent arena, object - a pointer from it, or NULL
+// Postcondition: vlad_get_root(a) returns object, in this and later
+//                openings of the file (at the address it maps to then)
+
+void vlad_set_root(vlad_arena_t *a, void *object)
+{
+   pthread_mutex_lock(&a->lock);
+   a->persist->root = (object == NULL) ? PERSIST_NO_ROOT
+      : (u_int64_t)((byte *)object - a->memory);
+   pthread_mutex_unlock(&a->lock);
+}
+
+
+// Input: a - a persistent arena
+// Output: the object last given to vlad_set_root(a, ...), or NULL
+
+void *vlad_get_root(vlad_arena_t *a)
+{
+   pthread_mutex_lock(&a->lock);
+   u_int64_t root = a->persist->root;
+   pthread_mutex_unlock(&a->lock);
+   return (root == PERSIST_NO_ROOT) ? NULL : a->memory + root;
+}
+
+
+// Input: a - an arena, fd - a file descriptor open for writing
+// Output: 0, or -1 if writing failed
+// Postcondition: as for vlad_snapshot(), but of a alone
+
+int vlad_arena_snapshot(vlad_arena_t *a, int fd)
+{
+   snapshot_header_t header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION,
+                               HEADER_SIZE, MIN_ORDER};
+   snapshot_arena_t end = {0, 0, 0, 0};
+   if (writeAll(fd, &header, sizeof(header)) < 0
+      || snapshotArena(a, NULL, fd) < 0) {
+      return -1;
+   }
+   return writeAll(fd, &end, sizeof(end));
+}
+
+
+// Arena functions below:
+
+// Function that gets size bytes of zeroed memory straight from the OS.
+// Pages are only committed as they are first touched, so this takes the
+// same time for any size. The memory starts on a multiple of align (a
+// power of two, or 0 for any page). VLAD_HUGE_PAGES in flags asks for
+// huge pages.
+void *mapMemory(size_t size, size_t align, int flags) {
+   byte *mem = reserveAligned(size, align, 0);
+   if (mem == NULL) {
+      return NULL;
+   }
+#ifdef MADV_HUGEPAGE
+   if (flags & VLAD_HUGE_PAGES) {
+      madvise(mem, size, MADV_HUGEPAGE);
+   }
+#endif
+   return mem;
+}
+
+// Function that reserves size bytes of address space such that the byte
+// at offset `at` lies on a multiple of align, and returns its start.
+byte *reserveAligned(size_t size, size_t align, size_t at) {
+   // mmap only promises page alignment, so for more, map align bytes
+   // extra and give back what lies either side of the aligned part.
+   size_t slack = (align > PAGE_SIZE_MIN) ? align : 0;
+   byte *mem = mmap(NULL, size + slack, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (mem == MAP_FAILED) {
+      return NULL;
+   }
+   if (slack == 0) {
+      return mem;
+   }
+   byte *start = mem + ((align - ((uintptr_t)mem + at) % align) % align);
+   if (start > mem) {
+      munmap(mem, start - mem);
+   }
+   if (start + size < mem + size + slack) {
+      munmap(start + size, (mem + size + slack) - (start + size));
+   }
+   return start;
+}
+
+// Function that returns the # bytes in the slab_pages bitmap of an
+// arena of the given size.
+size_t whatSlabPagesSize(vsize_t size) {
+   return (size / SLAB_SIZE + 63) / 64 * sizeof(u_int64_t);
+}
+
+// Function that lays a's position bitmaps out from bits, or only counts
+// them if bits is NULL, and returns the # bytes they take.
+size_t whatPositionLayout(arena_t *a, u_int64_t *bits) {
+   size_t words = 0;
+   u_int32_t order;
+   for (order = MIN_ORDER; order <= whatOrder(a->memory_size); order++) {
+      size_t n = ((a->memory_size >> order) + 63) / 64;
+      if (bits != NULL) {
+         a->free_bits[order] = bits + words;
+         a->free_summary[order] = bits + words + n;
+      }
+      words += n + (n + 63) / 64;
+   }
+   return words * sizeof(u_int64_t);
+}
+
+// Sets up a as a single free block of size bytes starting at mem.
+// Returns 0, or -1 if the arena's metadata cannot be allocated.
+int arenaInit(arena_t *a, byte *mem, vsize_t size, int flags) {
+   a->memory = mem;
+   a->memory_size = size;
+   a->flags = flags;
+   a->persist = NULL;
+   a->slab_pages = NULL;
+   if (size >= SLAB_MIN_ARENA) {
+      a->slab_pages = mapMemory(whatSlabPagesSize(size), 0, 0);
+   }
+   a->position_bits = NULL;
+   if (flags & VLAD_ADDRESS_ORDER) {
+      a->position_size = whatPositionLayout(a, NULL);
+      a->position_bits = mapMemory(a->position_size, 0, 0);
+      if (a->position_bits != NULL) {
+         whatPositionLayout(a, a->position_bits);
+      }
+   }
+   a->block_meta = mapMemory(size >> MIN_ORDER, 0, 0);
+   if (a->block_meta == NULL
+      || ((flags & VLAD_ADDRESS_ORDER) && a->position_bits == NULL)) {
+      if (a->slab_pages != NULL) {
+         munmap(a->slab_pages, whatSlabPagesSize(size));
+      }
+      if (a->position_bits != NULL) {
+         munmap(a->position_bits, a->position_size);
+      }
+      if (a->block_meta != NULL) {
+         munmap(a->block_meta, size >> MIN_ORDER);
+      }
+      return -1;
+   }
+   pthread_mutex_init(&a->lock, NULL);
+
+   arenaFormat(a, 1);   // mem must come zeroed, e.g. from mmap
+   return 0;
+}
+
+// Makes a's memory one free block again, forgetting every allocation.
+// isZero says whether the memory is known to be all zero.
+void arenaFormat(arena_t *a, int isZero) {
+   a->free_orders = 0;
+   a->slab_partial = 0;
+   a->quick_orders = 0;
+   memset(a->quick_counts, 0, sizeof(a->quick_counts));
+   if (a->position_bits != NULL) {
+      // Dropping the pages clears them, without touching every one.
+      madvise(a->position_bits, a->position_size, MADV_DONTNEED);
+   }
+   memset(a->free_counts, 0, sizeof(a->free_counts));
+   a->live = a->splits = a->merges = a->requested = a->granted = 0;
+   a->purged = a->purge_next = a->purge_last = 0;
+   memset(a->quick_times, 0, sizeof(a->quick_times));
+   a->purge_ticks = 0;
+   a->remote_frees = NULL;
+   a->n_marks = 0;
+   if (a->slab_pages != NULL) {
+      memset(a->slab_pages, 0, whatSlabPagesSize(a->memory_size));
+   }
+
+   free_header_t *header = (free_header_t *) a->memory;
+   header->size = a->memory_size;
+   pushFree(a, header);
+   if (isZero) {
+      a->block_meta[0] |= META_ZERO;
+   } else if (a->memory_size >= whatSize(PURGE_MIN_ORDER)) {
+      *whatFreeTime(header) = whatCoarseTime();
+   }
+}
+
+// Releases a's lock and metadata, but not its memory.
+void arenaEnd(arena_t *a) {
+   pthread_mutex_destroy(&a->lock);
+   if (a->persist != NULL) {
+      return;   // the metadata is part of the file's mapping
+   }
+   if (a->slab_pages != NULL) {
+      munmap(a->slab_pages, whatSlabPagesSize(a->memory_size));
+   }
+   if (a->position_bits != NULL) {
+      munmap(a->position_bits, a->position_size);
+   }
+   munmap(a->block_meta, a->memory_size >> MIN_ORDER);
+}
+
+// vlad_malloc on a single arena, with its lock held.
+void *arenaMalloc(arena_t *a, size_t n) {
+   return arenaMallocOrder(a, n, 0);
+}
+
+// As arenaMalloc(), given n's buddy order, or 0 to work it out.
+void *arenaMallocOrder(arena_t *a, size_t n, u_int32_t order) {
+   drainRemote(a);
+   void *object = NULL;
+   if (n <= SLAB_MAX && a->slab_pages != NULL && a->n_marks == 0) {
+      object = slabMalloc(a, n);
+   }
+   if (object == NULL) {
+      object = (order != 0) ? buddyMallocOrder(a, n, order, NULL)
+                            : buddyMalloc(a, n, NULL);
+   }
+   if (object == NULL && releaseSlabs(a)) {
+      object = (order != 0) ? buddyMallocOrder(a, n, order, NULL)
+                            : buddyMalloc(a, n, NULL);
+   }
+   if (object != NULL) {
+      countAlloc(a, n, object);
+   }
+   return object;
+}
+
+// vlad_memalign on a single arena, with its lock held.
+void *arenaMemalign(arena_t *a, size_t alignment, size_t n) {
+   // Blocks lie on multiples of their size from the arena's start, and
+   // the arena lies on a multiple of its own size, so a block of order
+   // k is 2^k-aligned; data just past a header is HEADER_SIZE-aligned.
+   if (alignment <= sizeof(void *)) {
+      return arenaMalloc(a, n);
+   }
+   drainRemote(a);
+   if (alignment > a->memory_size || n > a->memory_size) {
+      return NULL;
+   }
+   u_int32_t header = whatHeaderSize(a);
+   size_t want = n;
+   if (alignment > HEADER_SIZE) {
+      // Without a header the block itself can be handed out; otherwise
+      // the data goes alignment bytes in, with a header placed before
+      // it pointing back at the block's own.
+      want = (header == 0) ? ((n > alignment) ? n : alignment)
+                           : n + alignment - header;
+   }
+   void *object = buddyMalloc(a, want, NULL);
+   if (object == NULL && releaseSlabs(a)) {
+      object = buddyMalloc(a, want, NULL);
+   }
+   if (object == NULL) {
+      return NULL;
+   }
+   if (header != 0 && alignment > HEADER_SIZE) {
+      byte *data = (byte *)object + alignment - header;
+      free_header_t *placed = (free_header_t *)(data - HEADER_SIZE);
+      placed->magic = MAGIC_ALIGNED;
+      placed->size = data - (byte *)object;
+      object = data;
+   }
+   countAlloc(a, n, object);
+   return object;
+}
+
+// vlad_calloc on a single arena, with its lock held.
+void *arenaCalloc(arena_t *a, size_t n) {
+   drainRemote(a);
+   if (n <= SLAB_MAX && a->slab_pages != NULL && a->n_marks == 0) {
+      void *object = slabMalloc(a, n);
+      if (object != NULL) {
+         memset(object, 0, n);
+         countAlloc(a, n, object);
+         return object;
+      }
+   }
+   int isZero;
+   void *object = buddyMalloc(a, n, &isZero);
+   if (object == NULL && releaseSlabs(a)) {
+      object = buddyMalloc(a, n, &isZero);
+   }
+   if (object == NULL) {
+      return NULL;
+   }
+
+   // Only a block that has been used since it was last known to be zero
+   // needs clearing. Otherwise just the old free list header is dirty,
+   // and that is only inside the data if the block has no header.
+   if (!isZero) {
+      memset(object, 0, n);
+   } else if (whatHeaderSize(a) == 0) {
+      memset(object, 0, (n < HEADER_SIZE) ? n : HEADER_SIZE);
+   }
+   countAlloc(a, n, object);
+   return object;
+}
+
+// vlad_free on a single arena, with its lock held.
+void arenaFree(arena_t *a, void *object) {
+   a->live--;
+   if (whatSlab(a, object) != NULL) {
+      slabFree(a, object);
+   } else {
+      buddyFree(a, object);
+   }
+   maybePurge(a);
+}
+
+// Resizes the region object points to, to hold n bytes, without moving
+// it. Returns 1 if that could be done, 0 if the region must move.
+int arenaResize(arena_t *a, void *object, size_t n) {
+   // A slab slot can only ever hold its class size.
+   if (whatSlab(a, object) != NULL) {
+      return n <= whatUsableSize(a, object);
+   }
+   // Aligned data stays where it is, so count what lies before it.
+   vaddr_t index = whatBlock(a, object);
+   size_t lead = (byte *)object - (a->memory + index);
+   if (n > a->memory_size - lead) {
+      return 0;
+   }
+
+   free_header_t *ptr = whatAddress(a, index);
+   u_int32_t order = a->block_meta[index >> MIN_ORDER] & META_ORDER;
+   u_int32_t want = whatOrderUp(n + lead);
+
+   // Shrink by splitting off upper halves and freeing them. Each such
+   // half's buddy is the block being kept, so none of them can merge.
+   while (order > want) {
+      order--;
+      free_header_t *upper = whatAddress(a, index + whatSize(order));
+      upper->size = whatSize(order);
+      pushFree(a, upper);
+      if (order >= PURGE_MIN_ORDER) {
+         *whatFreeTime(upper) = whatCoarseTime();
+      }
+      a->splits++;
+   }
+
+   // Grow only if, at every order on the way up, the block is the lower
+   // half of its pair and the upper half is free and whole.
+   u_int32_t o;
+   for (o = order; o < want; o++) {
+      if (index & whatSize(o)) {
+         return 0;
+      }
+      byte meta = a->block_meta[(index + whatSize(o)) >> MIN_ORDER];
+      if ((meta & META_ALLOC) || (meta & META_ORDER) != o) {
+         return 0;
+      }
+   }
+   for (o = order; o < want; o++) {
+      unlinkFree(a, whatAddress(a, index + whatSize(o)));
+      a->merges++;
+   }
+
+   if (whatHeaderSize(a) != 0) {
+      ptr->size = whatSize(want);
+   }
+   setMeta(a, index, want, 1);
+   return 1;
+}
+
+// Function that returns the # bytes usable at object.
+size_t whatUsableSize(arena_t *a, void *object) {
+   slab_header_t *slab = whatSlab(a, object);
+   if (slab != NULL) {
+      return slab_sizes[slab->size_class];
+   }
+   vaddr_t index = whatBlock(a, object);
+   u_int32_t order = a->block_meta[index >> MIN_ORDER] & META_ORDER;
+   return whatSize(order) - ((byte *)object - (a->memory + index));
+}
+
+// vlad_malloc on the arena's buddy blocks, bypassing slabs.
+void *buddyMalloc(arena_t *a, size_t n, int *isZero) {
+   // Nothing bigger than the whole of memory can ever be found.
+   if (n > a->memory_size - whatHeaderSize(a)) {
+      return NULL;
+   }
+   return buddyMallocOrder(a, n, whatOrderUp(n + whatHeaderSize(a)), isZero);
+}
+
+// As buddyMalloc(), given the order of block n needs, which must fit.
+void *buddyMallocOrder(arena_t *a, size_t n, u_int32_t order, int *isZero) {
+   // A block of just this order freed lately needs no splitting at all.
+   if (a->quick_orders & (1ull << order)) {
+      free_header_t *ptr = popQuick(a, order);
+      if (isZero != NULL) {
+         *isZero = 0;
+      }
+      ptr->magic = MAGIC_ALLOC;
+      return ((void*)ptr + whatHeaderSize(a));
+   }
+
+   // The smallest non-empty free list of at least this order holds
+   // the best fit; if there is none, no chunk is big enough for n
+   // unless the quick lists' blocks merge into one.
+   u_int64_t fits = a->free_orders & ~((1ull << order) - 1);
+   if (fits == 0 && a->quick_orders != 0) {
+      flushQuick(a);
+      fits = a->free_orders & ~((1ull << order) - 1);
+   }
+   if (fits == 0) {
+      return NULL;
+   }
+   free_header_t *ptr = whatAddress(a,
+                                    whatFirstFree(a, __builtin_ctzll(fits)));
+
+   // Ensure the block to be allocated is free:
+   if (!magicFreeOK(ptr)) {
+      fprintf(stderr, "Attempt to allocate non-free memory");
+      abort();
+   } 
+   unlinkFree(a, ptr);
+
+   // Split it up until it is the right order, each upper half going
+   // back onto the free list one order down.
+   while (ptr->size > whatSize(order)) {   
+      insertHalve(a, ptr);
+   }
+
+   assert(ptr->size >= n + whatHeaderSize(a));
+         //printf("passed assert on size!\n");
+
+   if (isZero != NULL) {
+      *isZero = (a->block_meta[whatIndex(a, ptr) >> MIN_ORDER] & META_ZERO);
+   }
+
+   // Set header magic to MAGIC_ALLOC (the header is dropped, and only
+   // the metadata says the block is in use, for VLAD_NO_HEADERS)
+   ptr->magic = MAGIC_ALLOC;
+   setMeta(a, whatIndex(a, ptr), order, 1);
+
+   return ((void*)ptr + whatHeaderSize(a));
+}
+
+// vlad_free on the arena's buddy blocks, bypassing slabs.
+void buddyFree(arena_t *a, void *object) {
+   free_header_t *ptr = checkAllocated(a, object);
+   if (ptr->magic == MAGIC_MARKED) {
+      untrackBlock(a, ptr);
+   }
+   if ((a->flags & VLAD_LAZY) && ptr->size <= whatSize(QUICK_MAX_ORDER)) {
+      pushQuick(a, ptr);
+   } else {
+      coalesce(a, ptr);
+   }
+}
+
+// Function that checks object is the data of an allocated block, and
+// returns that block with its header's size filled in.
+free_header_t *checkAllocated(arena_t *a, void *object) {
+   vaddr_t index = whatBlock(a, object);
+   free_header_t *ptr = whatAddress(a, index);
+   byte meta = a->block_meta[index >> MIN_ORDER];
+
+   // Check that block to be freed is valid:
+   if (index >= a->memory_size || index % whatSize(MIN_ORDER) != 0
+      || !(meta & META_ALLOC)
+      || (whatHeaderSize(a) != 0 && !magicAllocOK(ptr))) {
+      fprintf(stderr, "Attempt to free non-allocated memory");
+      abort();
+   } 
+   ptr->size = whatSize(meta & META_ORDER);
+   return ptr;
+}
+
+// Merges the block ptr is pointing to with its buddies for as long as
+// they are free, then puts the result on its free list.
+void coalesce(arena_t *a, free_header_t *ptr) {
+   // Merge with the buddy one order at a time for as long as
+   // the buddy is free and whole; the lower of the pair survives.
+   // The result counts as freed when the oldest dirty part of it was.
+   u_int64_t freed = 0;
+   free_header_t *buddy;
+   while ((buddy = findBuddy(a, ptr)) != NULL) {
+      if (buddy->size >= whatSize(PURGE_MIN_ORDER)
+         && !(a->block_meta[whatIndex(a, buddy) >> MIN_ORDER] & META_ZERO)
+         && (freed == 0 || *whatFreeTime(buddy) < freed)) {
+         freed = *whatFreeTime(buddy);
+      }
+      unlinkFree(a, buddy);
+      if (buddy < ptr) {
+         // So that freeing it again is caught, with headers or without.
+         ptr->magic = MAGIC_FREE;
+         a->block_meta[whatIndex(a, ptr) >> MIN_ORDER] &= ~META_ALLOC;
+         ptr = buddy;
+      }
+      ptr->size = (ptr->size)*2;
+      a->merges++;
+         //printf("Merged at %d, size is:%d\n", whatIndex(a, ptr), ptr->size);
+   }
+
+   pushFree(a, ptr);
+   if (ptr->size >= whatSize(PURGE_MIN_ORDER)) {
+      *whatFreeTime(ptr) = (freed != 0) ? freed : whatCoarseTime();
+      a->purge_ticks = 0;   // so the next maybePurge() looks at once
+   }
+}
+
+// Adds the freed block ptr is pointing to to the quick list for its
+// order, or merges it if that list is full.
+void pushQuick(arena_t *a, free_header_t *ptr) {
+   // Merging only the overflow, rather than the whole list at once,
+   // keeps any one free from taking long.
+   u_int32_t order = whatOrder(ptr->size);
+   if (a->quick_counts[order] >= QUICK_LIMIT) {
+      coalesce(a, ptr);
+      return;
+   }
+   ptr->magic = MAGIC_QUICK;
+   if (!(a->quick_orders & (1ull << order))) {
+      a->quick_times[order] = a->purge_last;   // see maybePurge()
+   }
+   ptr->next = (a->quick_orders & (1ull << order)) ? a->quick_lists[order]
+                                                   : whatIndex(a, ptr);
+   a->quick_lists[order] = whatIndex(a, ptr);
+   a->quick_orders |= (1ull << order);
+   a->quick_counts[order]++;
+}
+
+// Takes the first block off the quick list for order.
+free_header_t *popQuick(arena_t *a, u_int32_t order) {
+   // The last block on a list links to itself.
+   free_header_t *ptr = whatAddress(a, a->quick_lists[order]);
+   if (ptr->next == whatIndex(a, ptr)) {
+      a->quick_orders &= ~(1ull << order);
+   }
+   a->quick_lists[order] = ptr->next;
+   a->quick_counts[order]--;
+   a->quick_times[order] = a->purge_last;
+   return ptr;
+}
+
+// Merges every block on a's quick lists into the free lists.
+void flushQuick(arena_t *a) {
+   while (a->quick_orders != 0) {
+      coalesce(a, popQuick(a, __builtin_ctzll(a->quick_orders)));
+   }
+}
+
+
+// Allocates up to count blocks of n bytes into objects[], returning how
+// many were allocated. Blocks come from the free list of the right order
+// first; then each larger block taken is carved up in one pass, rather
+// than halved one order at a time for every block.
+int arenaMallocBatch(arena_t *a, size_t n, int count, void **objects) {
+   drainRemote(a);
+   int done = 0;
+   if (n <= SLAB_MAX && a->slab_pages != NULL && a->n_marks == 0) {
+      while (done < count
+         && (objects[done] = slabMalloc(a, n)) != NULL) {
+         countAlloc(a, n, objects[done]);
+         done++;
+      }
+   }
+   if (done == count || n > a->memory_size - whatHeaderSize(a)) {
+      return done;
+   }
+
+   u_int32_t order = whatOrderUp(n + whatHeaderSize(a));
+   while (done < count) {
+      u_int64_t fits = a->free_orders & ~((1ull << order) - 1);
+      if (fits == 0 && a->quick_orders != 0) {
+         flushQuick(a);
+         continue;
+      }
+      if (fits == 0) {
+         break;
+      }
+      u_int32_t found = __builtin_ctzll(fits);
+      free_header_t *ptr = whatAddress(a, whatFirstFree(a, found));
+      vaddr_t index = whatIndex(a, ptr);
+      if (!magicFreeOK(ptr)) {
+         fprintf(stderr, "Attempt to allocate non-free memory");
+         abort();
+      } 
+      int isZero = a->block_meta[index >> MIN_ORDER] & META_ZERO;
+      u_int64_t freed = (!isZero && found >= PURGE_MIN_ORDER)
+                           ? *whatFreeTime(ptr) : 0;
+      unlinkFree(a, ptr);
+
+      // Hand out as many blocks from the front as are wanted,
+      // and free what is left behind them in one go.
+      vsize_t pieces = whatSize(found - order);
+      vsize_t i;
+      for (i = 0; i < pieces && done < count; i++) {
+         free_header_t *piece = whatAddress(a, index + (i << order));
+         piece->magic = MAGIC_ALLOC;
+         piece->size = whatSize(order);
+         setMeta(a, whatIndex(a, piece), order, 1);
+         objects[done++] = (void *)piece + whatHeaderSize(a);
+         countAlloc(a, n, objects[done - 1]);
+      }
+      // Carving one block into k pieces is k - 1 splits.
+      a->splits += i - 1
+         + pushFreeTail(a, index + (i << order), index + whatSize(found),
+                        isZero, freed);
+   }
+   return done;
+}
+
+// Puts the free region from index to end onto the free lists, as the
+// fewest buddy blocks, and returns how many that was. end must be the
+// end of a block index lies in, freed at time freed unless isZero.
+int pushFreeTail(arena_t *a, vaddr_t index, vaddr_t end, int isZero,
+                 u_int64_t freed) {
+   int pushed = 0;
+   while (index < end) {
+      // The largest block starting here is as big as index's alignment.
+      free_header_t *ptr = whatAddress(a, index);
+      ptr->size = whatSize(__builtin_ctzll(index));
+      pushFree(a, ptr);
+      if (isZero) {
+         a->block_meta[index >> MIN_ORDER] |= META_ZERO;
+      } else if (ptr->size >= whatSize(PURGE_MIN_ORDER)) {
+         *whatFreeTime(ptr) = freed;
+      }
+      index += ptr->size;
+      pushed++;
+   }
+   return pushed;
+}
+
+// Counts an allocation of n bytes, given object, for vlad_get_stats(),
+// and puts it on the mark list if a mark is set.
+void countAlloc(arena_t *a, size_t n, void *object) {
+   a->live++;
+   a->requested += n;
+   a->granted += whatUsableSize(a, object);
+   if (a->n_marks > 0) {
+      trackBlock(a, whatAddress(a, whatBlock(a, object)));
+   }
+}
+
+// Frees the objects, which are in address order. Neighbouring buddies
+// in the batch are merged with each other on a stack as they are met,
+// so only the resulting blocks touch the free lists.
+void arenaFreeBatch(arena_t *a, void **objects, int count) {
+   free_header_t **stack = (free_header_t **)objects;
+   int top = 0;
+   int i;
+   a->live -= count;
+   for (i = 0; i < count; i++) {
+      if (whatSlab(a, objects[i]) != NULL) {
+         slabFree(a, objects[i]);
+         continue;
+      }
+      free_header_t *ptr = checkAllocated(a, objects[i]);
+      if (ptr->magic == MAGIC_MARKED) {
+         untrackBlock(a, ptr);
+      }
+      while (top > 0 && stack[top - 1]->size == ptr->size
+         && (whatIndex(a, stack[top - 1]) ^ ptr->size) == whatIndex(a, ptr)) {
+         ptr->magic = MAGIC_FREE;   // as in coalesce()
+         a->block_meta[whatIndex(a, ptr) >> MIN_ORDER] &= ~META_ALLOC;
+         ptr = stack[--top];
+         ptr->size = (ptr->size)*2;
+         a->merges++;
+      }
+      stack[top++] = ptr;
+   }
+
+   for (i = 0; i < top; i++) {
+      coalesce(a, stack[i]);
+   }
+   maybePurge(a);
+}
+
+// Orders pointers by address, for qsort().
+int compareAddress(const void *x, const void *y) {
+   byte *p = *(byte **)x;
+   byte *q = *(byte **)y;
+   return (p > q) - (p < q);
+}
+
+
+// Heap functions below:
+
+// vlad_malloc/vlad_free/vlad_calloc/vlad_memalign on the whole heap,
+// without tracing.
+void *heapMalloc(size_t n) {
+   if (isHugeSize(n)) {
+      void *object = hugeMalloc(1, n);
+      if (object != NULL) {
+         return object;
+      }
+   }
+   // Try the calling thread's own arena first, then the others in turn
+   // so that one busy thread does not run out while memory is free.
+   arena_t *home = whatArena();
+   int i;
+   for (i = 0; i < n_arenas; i++) {
+      arena_t *a = &arenas[(home - arenas + i) % n_arenas];
+      void *object = vlad_arena_malloc(a, n);
+      if (object != NULL) {
+         return object;
+      }
+   }
+   return regionMalloc(1, n, 0);
+}
+
+void heapFree(void *object) {
+   // The block goes back to whichever arena it came from. Another
+   // thread's arena is not locked, but queued on for it to free later.
+   arena_t *a = whatOwner(object);
+   if (a == whatArena()) {
+      vlad_arena_free(a, object);
+   } else if (a != NULL) {
+      pushRemote(a, object);
+   } else {
+      regionFree(object);
+   }
+}
+
+void *heapCalloc(size_t count, size_t size) {
+   if (size != 0 && count > SIZE_MAX / size) {
+      return NULL;
+   }
+   if (isHugeSize(count * size)) {
+      void *object = hugeMalloc(1, count * size);   // fresh pages are zero
+      if (object != NULL) {
+         return object;
+      }
+   }
+
+   arena_t *home = whatArena();
+   int i;
+   for (i = 0; i < n_arenas; i++) {
+      arena_t *a = &arenas[(home - arenas + i) % n_arenas];
+      void *object = vlad_arena_calloc(a, count * size);
+      if (object != NULL) {
+         return object;
+      }
+   }
+   return regionMalloc(1, count * size, 1);
+}
+
+void *heapMemalign(size_t alignment, size_t n) {
+   if (isHugeSize(n) && isPowerOfTwo(alignment)) {
+      void *object = hugeMalloc(alignment, n);
+      if (object != NULL) {
+         return object;
+      }
+   }
+   arena_t *home = whatArena();
+   int i;
+   for (i = 0; i < n_arenas; i++) {
+      arena_t *a = &arenas[(home - arenas + i) % n_arenas];
+      void *object = vlad_arena_memalign(a, alignment, n);
+      if (object != NULL) {
+         return object;
+      }
+   }
+   if (!isPowerOfTwo(alignment)) {
+      return NULL;
+   }
+   return regionMalloc(alignment, n, 0);
+}
+
+// Resizes object to hold n bytes without copying it, and returns where
+// it is now, or NULL if it must be moved.
+void *heapResize(void *object, size_t n, size_t *size) {
+   arena_t *a = whatOwner(object);
+   int inRegion = (a == NULL);
+   if (inRegion) {
+      pthread_rwlock_rdlock(&regions_lock);
+      a = whatRegion(object);
+   }
+   if (a == NULL) {
+      pthread_rwlock_unlock(&regions_lock);
+      huge_header_t *h = whatHuge(object);
+      if (h == NULL) {
+         fprintf(stderr, "Attempt to resize non-allocated memory");
+         abort();
+      }
+      *size = h->size - h->offset;
+      // One that is not huge any more moves back into an arena.
+      return isHugeSize(n) ? hugeResize(h, n) : NULL;
+   }
+   pthread_mutex_lock(&a->lock);
+   *size = whatUsableSize(a, object);
+   int resized = arenaResize(a, object, n);
+   pthread_mutex_unlock(&a->lock);
+   if (inRegion) {
+      pthread_rwlock_unlock(&regions_lock);
+   }
+   return resized ? object : NULL;
+}
+
+// Hands object, which lies in one of arenas[], to a's remote-free queue.
+void pushRemote(arena_t *a, void *object) {
+   // Objects are only pushed one at a time and taken all at once, so
+   // the same object coming back to the head (ABA) does no harm.
+   void *head = __atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED);
+   do {
+      *(void **)object = head;
+   } while (!__atomic_compare_exchange_n(&a->remote_frees, &head, object, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Frees everything on a's remote-free queue, with its lock held.
+void drainRemote(arena_t *a) {
+   maybePurge(a);
+   if (__atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED) == NULL) {
+      return;
+   }
+   void *object = __atomic_exchange_n(&a->remote_frees, NULL,
+                                      __ATOMIC_ACQUIRE);
+   // Free them in address-ordered batches so that neighbours merge with
+   // each other first. Each link is read before its object is freed.
+   void *batch[REMOTE_BATCH];
+   while (object != NULL) {
+      int count = 0;
+      while (object != NULL && count < REMOTE_BATCH) {
+         batch[count++] = object;
+         object = *(void **)object;
+      }
+      qsort(batch, count, sizeof(void *), compareAddress);
+      arenaFreeBatch(a, batch, count);
+   }
+}
+
+// Appends one record to the trace, or for traceRealloc fills in the
+// pair of records, from slot on, for a realloc from old to moved.
+void traceRecord(u_int32_t op, size_t size, void *object) {
+   u_int64_t slot = __atomic_fetch_add(&trace->written, 1, __ATOMIC_RELAXED);
+   traceWrite(slot, op, size, object);
+}
+
+void traceRealloc(u_int64_t slot, size_t n, void *old, void *moved) {
+   traceWrite(slot, TRACE_REALLOC, n, old);
+   traceWrite(slot + 1, TRACE_MOVED, 0, moved);
+}
+
+// Fills in trace record number slot.
+void traceWrite(u_int64_t slot, u_int32_t op, size_t size, void *object) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   u_int64_t now = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+   u_int64_t delta = (trace_last == 0) ? 0 : now - trace_last;
+   trace_last = now;
+
+   trace_record_t *r = &trace_ring[slot % trace->capacity];
+   r->delta = (delta > UINT32_MAX) ? UINT32_MAX : delta;
+   r->op = op;
+   r->size = size;
+   r->offset = (object == NULL) ? TRACE_FAILED
+      : (int64_t)((uintptr_t)object - (uintptr_t)memory);
+}
+
+// Handlers for pthread_atfork(). Every lock is held over a fork, so the
+// child gets the heap in a consistent state, with its locks free.
+void forkPrepare(void) {
+   if (arenas == NULL) {
+      return;
+   }
+   pthread_rwlock_wrlock(&regions_lock);
+   int i;
+   for (i = 0; i < n_arenas + n_regions; i++) {
+      pthread_mutex_lock((i < n_arenas) ? &arenas[i].lock
+                                        : &regions[i - n_arenas]->lock);
+   }
+   pthread_mutex_lock(&huge_lock);
+}
+
+void forkParent(void) {
+   if (arenas == NULL) {
+      return;
+   }
+   int i;
+   for (i = 0; i < n_arenas + n_regions; i++) {
+      pthread_mutex_unlock((i < n_arenas) ? &arenas[i].lock
+                                          : &regions[i - n_arenas]->lock);
+   }
+   pthread_mutex_unlock(&huge_lock);
+   pthread_rwlock_unlock(&regions_lock);
+}
+
+void forkChild(void) {
+   if (arenas == NULL) {
+      return;
+   }
+   // Only the forking thread lives on in the child, so start the locks
+   // afresh rather than unlock what may count as another thread's.
+   int i;
+   for (i = 0; i < n_arenas + n_regions; i++) {
+      pthread_mutex_init((i < n_arenas) ? &arenas[i].lock
+                                        : &regions[i - n_arenas]->lock, NULL);
+   }
+   pthread_rwlock_init(&regions_lock, NULL);
+   pthread_mutex_init(&huge_lock, NULL);
+}
+
+
+// Purge functions below:
+
+// Gives back to the OS the pages of a's free blocks that have been free
+// for at least decay nanoseconds by now, with a's lock held.
+size_t purgeArena(arena_t *a, u_int64_t now, u_int64_t decay) {
+   // A persistent arena's pages are its file's, and would not read back
+   // as zero.
+   if (a->persist != NULL) {
+      return 0;
+   }
+   size_t purged = 0;
+   u_int64_t orders = a->free_orders & ~((1ull << PURGE_MIN_ORDER) - 1);
+   while (orders != 0) {
+      u_int32_t order = __builtin_ctzll(orders);
+      orders &= orders - 1;
+      free_header_t *first = whatAddress(a, a->free_lists[order]);
+      free_header_t *ptr = first;
+      do {
+         byte *meta = &a->block_meta[whatIndex(a, ptr) >> MIN_ORDER];
+         if (!(*meta & META_ZERO) && now - *whatFreeTime(ptr) >= decay) {
+            size_t bytes = purgeBlock(ptr);
+            if (bytes != 0) {
+               *meta |= META_ZERO;
+               purged += bytes;
+            }
+         }
+         ptr = whatAddress(a, ptr->next);
+      } while (ptr != first);
+   }
+   return purged;
+}
+
+// As purgeArena() with no decay, after merging what is on a's quick and
+// remote-free lists and giving back its empty slabs.
+size_t arenaPurge(arena_t *a) {
+   drainRemote(a);
+   while (releaseSlabs(a)) {
+   }
+   flushQuick(a);
+   size_t purged = purgeArena(a, whatCoarseTime(), 0);
+   a->purged += purged;
+   return purged;
+}
+
+// Gives back the pages of a's blocks that have been free for
+// PURGE_DECAY_NS, with its lock held, if it is time to look again.
+void maybePurge(arena_t *a) {
+   if (a->purge_ticks != 0) {
+      a->purge_ticks--;
+      return;
+   }
+   a->purge_ticks = PURGE_TICKS - 1;
+   u_int64_t now = whatCoarseTime();
+   if (now < a->purge_next) {
+      return;
+   }
+   a->purge_next = now + PURGE_DECAY_NS / 4;
+
+   a->purge_last = now;
+
+   // A quick list left alone for PURGE_DECAY_NS is merged, so that a
+   // burst of frees that stopped short of coalesce() can go back too.
+   // What it merges into counts as freed now, and decays from here.
+   u_int64_t orders = a->quick_orders;
+   while (orders != 0) {
+      u_int32_t order = __builtin_ctzll(orders);
+      orders &= orders - 1;
+      if (now - a->quick_times[order] >= PURGE_DECAY_NS) {
+         while (a->quick_orders & (1ull << order)) {
+            coalesce(a, popQuick(a, order));
+         }
+      }
+   }
+   a->purged += purgeArena(a, now, PURGE_DECAY_NS);
+   a->purge_ticks = PURGE_TICKS - 1;
+}
+
+// Gives back the pages of the free block ptr is pointing to, all but
+// the one its header is on, which is cleared instead.
+size_t purgeBlock(free_header_t *ptr) {
+   size_t page = whatPageSize();
+   byte *start = (byte *)ptr + HEADER_SIZE;
+   byte *end = (byte *)ptr + ptr->size;
+   byte *pages = (byte *)(((uintptr_t)start + page - 1) & ~(page - 1));
+   if (pages >= end || madvise(pages, end - pages, MADV_DONTNEED) != 0) {
+      return 0;
+   }
+   memset(start, 0, pages - start);
+   return end - pages;
+}
+
+// Function that returns where the free block ptr is pointing to holds
+// the time it was freed.
+u_int64_t *whatFreeTime(free_header_t *ptr) {
+   return (u_int64_t *)((byte *)ptr + HEADER_SIZE);
+}
+
+// Function that returns the time in nanoseconds, to a few milliseconds.
+u_int64_t whatCoarseTime(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+   return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Function that returns the OS's page size.
+size_t whatPageSize(void) {
+   static size_t page;
+   if (page == 0) {
+      page = sysconf(_SC_PAGESIZE);
+   }
+   return page;
+}
+
+
+// Mark functions below:
+
+// Sets a mark in a, with its lock held, and returns the mark's block.
+free_header_t *arenaMark(arena_t *a) {
+   // Persistent arenas could be reopened with blocks still on the list.
+   if (whatHeaderSize(a) == 0 || a->persist != NULL) {
+      return NULL;
+   }
+   void *object = buddyMalloc(a, 0, NULL);
+   if (object == NULL && releaseSlabs(a)) {
+      object = buddyMalloc(a, 0, NULL);
+   }
+   if (object == NULL) {
+      return NULL;
+   }
+   free_header_t *mark = (free_header_t *)((byte *)object - HEADER_SIZE);
+   trackBlock(a, mark);
+   mark->magic = MAGIC_MARK;
+   a->n_marks++;
+   return mark;
+}
+
+// Frees every block allocated in a since mark, with its lock held.
+void arenaRewind(arena_t *a, free_header_t *mark) {
+   if (a->n_marks == 0 || mark->magic != MAGIC_MARK) {
+      fprintf(stderr, "Attempt to rewind to a mark not set");
+      abort();
+   }
+   // Blocks freed from other threads must come off the list first.
+   drainRemote(a);
+
+   // Take the blocks from the newest back, a batch at a time so that
+   // neighbours merge with each other before touching the free lists,
+   // until a mark is reached; drop it, and go on if it was a later one.
+   void *batch[REMOTE_BATCH];
+   for (;;) {
+      free_header_t *ptr = whatAddress(a, whatAddress(a, a->marked)->prev);
+      int count = 0;
+      while (ptr->magic == MAGIC_MARKED && count < REMOTE_BATCH) {
+         batch[count++] = (byte *)ptr + HEADER_SIZE;
+         ptr = whatAddress(a, ptr->prev);
+      }
+      if (count > 0) {
+         qsort(batch, count, sizeof(void *), compareAddress);
+         arenaFreeBatch(a, batch, count);
+         continue;
+      }
+      a->n_marks--;
+      if (a->n_marks > 0) {
+         untrackBlock(a, ptr);
+      }
+      ptr->magic = MAGIC_ALLOC;
+      buddyFree(a, (byte *)ptr + HEADER_SIZE);
+      if (ptr == mark) {
+         return;
+      }
+   }
+}
+
+// Adds the allocated block ptr is pointing to to the end of a's mark
+// list.
+void trackBlock(arena_t *a, free_header_t *ptr) {
+   vaddr_t index = whatIndex(a, ptr);
+   ptr->magic = MAGIC_MARKED;
+   if (a->n_marks == 0) {
+      ptr->next = ptr->prev = index;   // the first mark, alone
+      a->marked = index;
+      return;
+   }
+   free_header_t *first = whatAddress(a, a->marked);
+   whatAddress(a, first->prev)->next = index;
+   ptr->prev = first->prev;
+   ptr->next = a->marked;
+   first->prev = index;
+}
+
+// Takes the block ptr is pointing to off a's mark list. It is never the
+// oldest mark while others are set, so a->marked stays as it is.
+void untrackBlock(arena_t *a, free_header_t *ptr) {
+   whatAddress(a, ptr->prev)->next = ptr->next;
+   whatAddress(a, ptr->next)->prev = ptr->prev;
+}
+
+
+// Snapshot functions below:
+
+// Writes the section of a snapshot for arena a, or if a is NULL for the
+// region whose memory starts at region, to fd.
+int snapshotArena(arena_t *a, byte *region, int fd) {
+   snapshot_run_t runs[SNAPSHOT_RUNS];
+   int n = 0;
+   vaddr_t index = 0;
+   int started = 0;
+   vsize_t size = 1;
+   while (index < size) {
+      arena_t *at = a;
+      if (a == NULL) {
+         pthread_rwlock_rdlock(&regions_lock);
+         at = whatRegion(region);
+         if (at == NULL || at->memory != region) {
+            pthread_rwlock_unlock(&regions_lock);
+            break;
+         }
+      }
+      pthread_mutex_lock(&at->lock);
+      snapshot_arena_t section = {(uintptr_t)at->memory, at->memory_size,
+                                  at->flags, a == NULL};
+      size = at->memory_size;
+      index = snapshotChunk(at, index, runs, &n);
+      pthread_mutex_unlock(&at->lock);
+      if (a == NULL) {
+         pthread_rwlock_unlock(&regions_lock);
+      }
+
+      if (!started && writeAll(fd, &section, sizeof(section)) < 0) {
+         return -1;
+      }
+      started = 1;
+      // The last run is kept back, as the next chunk may extend it.
+      if (n > 1 && writeAll(fd, runs, (n - 1) * sizeof(runs[0])) < 0) {
+         return -1;
+      }
+      if (n > 1) {
+         runs[0] = runs[n - 1];
+         n = 1;
+      }
+   }
+   if (!started) {
+      return 0;   // the region went before any of it was seen
+   }
+   runs[n].offset = index;
+   runs[n].count = 0;
+   runs[n].order = 0;
+   runs[n].state = 0;
+   return writeAll(fd, runs, (n + 1) * sizeof(runs[0]));
+}
+
+// Walks up to SNAPSHOT_BLOCKS blocks of a from index, with its lock
+// held, adding them to the *n runs in runs[]. Returns the index to carry
+// on from.
+vaddr_t snapshotChunk(arena_t *a, vaddr_t index, snapshot_run_t *runs,
+                      int *n) {
+   // Blocks may have merged since the last chunk, so that index is no
+   // longer the start of one; carry on after the block it is now in.
+   vaddr_t start = whatContainingBlock(a, index);
+   if (start < index) {
+      index = start + whatSize(a->block_meta[start >> MIN_ORDER]
+                               & META_ORDER);
+   }
+   int blocks;
+   for (blocks = 0; blocks < SNAPSHOT_BLOCKS && index < a->memory_size;
+        blocks++) {
+      byte meta = a->block_meta[index >> MIN_ORDER];
+      u_int32_t order = meta & META_ORDER;
+      u_int32_t state = whatSnapshotState(a, index, meta);
+      snapshot_run_t *last = (*n > 0) ? &runs[*n - 1] : NULL;
+      if (last != NULL && last->order == order && last->state == state
+         && last->count < UINT32_MAX
+         && last->offset + ((u_int64_t)last->count << order) == index) {
+         last->count++;
+      } else if (*n < SNAPSHOT_RUNS - 1) {   // room for the end marker
+         runs[*n].offset = index;
+         runs[*n].count = 1;
+         runs[*n].order = order;
+         runs[*n].state = state;
+         runs[*n].pad[0] = runs[*n].pad[1] = 0;
+         (*n)++;
+      } else {
+         break;
+      }
+      index += whatSize(order);
+   }
+   return index;
+}
+
+// Function that returns the SNAPSHOT_* state of the block at index,
+// whose metadata byte is meta.
+u_int32_t whatSnapshotState(arena_t *a, vaddr_t index, byte meta) {
+   if (!(meta & META_ALLOC)) {
+      return SNAPSHOT_FREE;
+   }
+   vaddr_t p = index / SLAB_SIZE;
+   if (a->slab_pages != NULL && (meta & META_ORDER) == SLAB_ORDER
+      && (a->slab_pages[p / 64] & (1ull << (p % 64)))) {
+      return SNAPSHOT_SLAB;
+   }
+   // Without headers, the magic would be the first word of the data.
+   if (whatHeaderSize(a) != 0
+      && whatAddress(a, index)->magic == MAGIC_QUICK) {
+      return SNAPSHOT_QUICK;
+   }
+   return SNAPSHOT_USED;
+}
+
+// Function that returns the memory[] index of the block index lies in.
+vaddr_t whatContainingBlock(arena_t *a, vaddr_t index) {
+   // Only block starts have metadata that can be trusted, so go down
+   // from the whole arena: a block of a lower order than where it
+   // starts means that span was split, and then each half of it starts
+   // with a block too.
+   vaddr_t start = 0;
+   u_int32_t order = whatOrder(a->memory_size);
+   while ((a->block_meta[start >> MIN_ORDER] & META_ORDER) < order) {
+      order--;
+      start |= index & whatSize(order);
+   }
+   return start;
+}
+
+// Writes n bytes to fd, however many calls that takes.
+int writeAll(int fd, const void *buffer, size_t n) {
+   const byte *at = buffer;
+   while (n > 0) {
+      ssize_t done = write(fd, at, n);
+      if (done < 0 && errno == EINTR) {
+         continue;
+      }
+      if (done <= 0) {
+         return -1;
+      }
+      at += done;
+      n -= done;
+   }
+   return 0;
+}
+
+
+// Region functions below:
+
+// vlad_memalign, or vlad_calloc if isZero, on the regions, adding a new
+// region if none has room.
+void *regionMalloc(size_t alignment, size_t n, int isZero) {
+   pthread_rwlock_rdlock(&regions_lock);
+   void *object = regionsMalloc(alignment, n, isZero);
+   pthread_rwlock_unlock(&regions_lock);
+   if (object != NULL || memory == NULL) {
+      return object;
+   }
+
+   // A new region is as big as an arena, or big enough for n if more.
+   size_t need = n + alignment + HEADER_SIZE;
+   if (n > whatSize(MAX_ORDERS - 2) || need > whatSize(MAX_ORDERS - 1)) {
+      return NULL;
+   }
+   size_t size = whatSize(whatOrderUp(need));
+   if (size < memory_size) {
+      size = memory_size;
+   }
+
+   // Other threads may have added a region with room while the lock was
+   // let go; only if none has room is another added.
+   pthread_rwlock_wrlock(&regions_lock);
+   object = regionsMalloc(alignment, n, isZero);
+   if (object != NULL) {
+      pthread_rwlock_unlock(&regions_lock);
+      return object;
+   }
+   if (n_regions == max_regions) {
+      int more = (max_regions == 0) ? 8 : 2 * max_regions;
+      arena_t **grown = mapMemory(more * sizeof(arena_t *), 0, 0);
+      if (grown == NULL) {
+         pthread_rwlock_unlock(&regions_lock);
+         return NULL;
+      }
+      if (regions != NULL) {
+         memcpy(grown, regions, n_regions * sizeof(arena_t *));
+         munmap(regions, max_regions * sizeof(arena_t *));
+      }
+      regions = grown;
+      max_regions = more;
+   }
+   arena_t *a = vlad_arena_create_flags(size, VLAD_LAZY | VLAD_ADDRESS_ORDER);
+   if (a != NULL) {
+      int i = n_regions;
+      while (i > 0 && regions[i - 1]->memory > a->memory) {
+         regions[i] = regions[i - 1];
+         i--;
+      }
+      regions[i] = a;
+      n_regions++;
+      object = isZero ? arenaCalloc(a, n) : arenaMemalign(a, alignment, n);
+   }
+   pthread_rwlock_unlock(&regions_lock);
+   return object;
+}
+
+// vlad_memalign, or vlad_calloc if isZero, on the regions there are.
+// regions_lock must be held.
+void *regionsMalloc(size_t alignment, size_t n, int isZero) {
+   void *object = NULL;
+   int i;
+   for (i = 0; i < n_regions && object == NULL; i++) {
+      arena_t *a = regions[i];
+      pthread_mutex_lock(&a->lock);
+      object = isZero ? arenaCalloc(a, n) : arenaMemalign(a, alignment, n);
+      pthread_mutex_unlock(&a->lock);
+   }
+   return object;
+}
+
+// vlad_free on an object in no arena: a region's, or else a huge block.
+// Drops the region if it is left free.
+void regionFree(void *object) {
+   pthread_rwlock_rdlock(&regions_lock);
+   arena_t *a = whatRegion(object);
+   if (a == NULL) {
+      pthread_rwlock_unlock(&regions_lock);
+      huge_header_t *h = whatHuge(object);
+      if (h == NULL) {
+         fprintf(stderr, "Attempt to free non-allocated memory");
+         abort();
+      }
+      hugeFree(h);
+      return;
+   }
+   pthread_mutex_lock(&a->lock);
+   arenaFree(a, object);
+   int unused = arenaUnused(a);
+   pthread_mutex_unlock(&a->lock);
+   pthread_rwlock_unlock(&regions_lock);
+
+   if (unused) {
+      releaseRegions();
+   }
+}
+
+// Gives back to the OS every free region but one, which is kept in
+// case it is needed again soon.
+void releaseRegions(void) {
+   pthread_rwlock_wrlock(&regions_lock);
+   int kept = 0;
+   int i = 0;
+   int j;
+   for (j = 0; j < n_regions; j++) {
+      arena_t *a = regions[j];
+      // Nothing else can be using a region while the lock is held.
+      if (arenaUnused(a) && kept++ > 0) {
+         vlad_arena_destroy(a);
+      } else {
+         regions[i++] = a;
+      }
+   }
+   n_regions = i;
+   pthread_rwlock_unlock(&regions_lock);
+}
+
+// Function that returns whether nothing in a is allocated, giving back
+// any empty slabs kept if they are all that is.
+int arenaUnused(arena_t *a) {
+   u_int64_t whole = 1ull << whatOrder(a->memory_size);
+   if (!(a->free_orders & whole) && a->slab_partial != 0) {
+      releaseSlabs(a);
+   }
+   if (!(a->free_orders & whole) && a->live == 0) {
+      flushQuick(a);
+   }
+   return (a->free_orders & whole) != 0;
+}
+
+
+// Huge block functions below:
+
+// Function that returns whether a request for n bytes is huge.
+int isHugeSize(size_t n) {
+   return n >= HUGE_MIN && n > memory_size / HUGE_FRACTION;
+}
+
+// Maps a huge block of n bytes, its data a multiple of alignment.
+void *hugeMalloc(size_t alignment, size_t n) {
+   size_t page = whatPageSize();
+   size_t lead = sizeof(huge_header_t);
+   if (alignment > lead) {
+      lead = alignment;   // the mapping is aligned as much, or to a page
+   }
+   if (lead > UINT32_MAX || n > SIZE_MAX - lead - page) {
+      return NULL;
+   }
+   size_t size = (lead + n + page - 1) & ~(page - 1);
+   byte *mem = mapMemory(size, (alignment > page) ? alignment : 0, 0);
+   if (mem == NULL) {
+      return NULL;
+   }
+   huge_header_t *h = (huge_header_t *)(mem + lead) - 1;
+   h->size = size;
+   h->offset = lead;
+   h->magic = MAGIC_HUGE;
+   pthread_mutex_lock(&huge_lock);
+   pushHuge(h);
+   pthread_mutex_unlock(&huge_lock);
+   return h + 1;
+}
+
+// Unmaps the huge block h is in front of.
+void hugeFree(huge_header_t *h) {
+   pthread_mutex_lock(&huge_lock);
+   unlinkHuge(h);
+   pthread_mutex_unlock(&huge_lock);
+   h->magic = 0;   // in case the OS hands the same pages straight back
+   munmap((byte *)(h + 1) - h->offset, h->size);
+}
+
+// Resizes the huge block h is in front of to hold n bytes, moving its
+// pages rather than copying them if it must move.
+void *hugeResize(huge_header_t *h, size_t n) {
+   // The pages may land anywhere, so aligned data would not stay so.
+   size_t page = whatPageSize();
+   if (h->offset != sizeof(huge_header_t)
+      || n > SIZE_MAX - sizeof(huge_header_t) - page) {
+      return NULL;
+   }
+   size_t size = (sizeof(huge_header_t) + n + page - 1) & ~(page - 1);
+   pthread_mutex_lock(&huge_lock);
+   unlinkHuge(h);
+   huge_header_t *moved = mremap(h, h->size, size, MREMAP_MAYMOVE);
+   if (moved == MAP_FAILED) {
+      pushHuge(h);
+      pthread_mutex_unlock(&huge_lock);
+      return NULL;
+   }
+   moved->size = size;
+   pushHuge(moved);
+   pthread_mutex_unlock(&huge_lock);
+   return moved + 1;
+}
+
+// Unmaps every huge block.
+void releaseHuge(void) {
+   pthread_mutex_lock(&huge_lock);
+   while (huge_blocks != NULL) {
+      huge_header_t *h = huge_blocks;
+      unlinkHuge(h);
+      h->magic = 0;
+      munmap((byte *)(h + 1) - h->offset, h->size);
+   }
+   pthread_mutex_unlock(&huge_lock);
+}
+
+// Function that returns the header of the huge block whose data object
+// is, or NULL if it is not one.
+huge_header_t *whatHuge(void *object) {
+   size_t page = whatPageSize();
+   huge_header_t *h = (huge_header_t *)object - 1;
+   // Data far enough into a page has its header on the same page; else
+   // the page before must be checked for being mapped at all, as it need
+   // not be if object is not vlad's.
+   byte *before = (byte *)((uintptr_t)h & ~(page - 1));
+   if (((uintptr_t)object & (page - 1)) < sizeof(huge_header_t)
+      && msync(before, page, MS_ASYNC) != 0) {
+      return NULL;
+   }
+   if (h->magic != MAGIC_HUGE
+      || (((uintptr_t)object - h->offset) & (page - 1)) != 0) {
+      return NULL;
+   }
+   return h;
+}
+
+// Adds h to the list of huge blocks. huge_lock must be held.
+void pushHuge(huge_header_t *h) {
+   h->prev = NULL;
+   h->next = huge_blocks;
+   if (huge_blocks != NULL) {
+      huge_blocks->prev = h;
+   }
+   huge_blocks = h;
+   huge_bytes += h->size;
+   huge_count++;
+}
+
+// Removes h from the list of huge blocks. huge_lock must be held.
+void unlinkHuge(huge_header_t *h) {
+   if (h->prev != NULL) {
+      h->prev->next = h->next;
+   } else {
+      huge_blocks = h->next;
+   }
+   if (h->next != NULL) {
+      h->next->prev = h->prev;
+   }
+   huge_bytes -= h->size;
+   huge_count--;
+}
+
+
+// Slab functions below:
+
+// vlad_malloc on the arena's slabs, for n <= SLAB_MAX.
+void *slabMalloc(arena_t *a, size_t n) {
+   u_int32_t class = 0;
+   while (slab_sizes[class] < n) {
+      class++;
+   }
+
+   // Take a slot from the first partial slab of the class,
+   // starting a new slab if every one of them is full.
+   slab_header_t *slab;
+   if (a->slab_partial & (1u << class)) {
+      slab = (slab_header_t *)(a->memory + a->slab_lists[class]);
+   } else {
+      byte *page = buddyMalloc(a, SLAB_SIZE - whatHeaderSize(a), NULL);
+      if (page == NULL) {
+         return NULL;
+      }
+      page -= whatHeaderSize(a);
+      slab = (slab_header_t *)(page + HEADER_SIZE);
+      setSlabPage(a, page, 1);
+      slab->size_class = class;
+      slab->n_slots = (SLAB_SIZE - SLAB_HEADER_SIZE) / slab_sizes[class];
+      slab->n_free = slab->n_slots;
+      int i;
+      for (i = 0; i < SLAB_WORDS; i++) {
+         int bits = slab->n_slots - 64 * i;
+         slab->free_slots[i] = (bits >= 64) ? ~0ull
+            : (bits > 0) ? (1ull << bits) - 1 : 0;
+      }
+      pushSlab(a, slab);
+   }
+
+   int word = 0;
+   while (slab->free_slots[word] == 0) {
+      word++;
+   }
+   int slot = 64 * word + __builtin_ctzll(slab->free_slots[word]);
+   slab->free_slots[word] &= ~(1ull << (slot % 64));
+   slab->n_free--;
+   if (slab->n_free == 0) {
+      unlinkSlab(a, slab);
+   }
+
+   byte *page = (byte *)slab - HEADER_SIZE;
+   return page + SLAB_HEADER_SIZE + slot * slab_sizes[class];
+}
+
+// vlad_free on the arena's slabs; object must lie in a slab.
+void slabFree(arena_t *a, void *object) {
+   slab_header_t *slab = whatSlab(a, object);
+   byte *page = (byte *)slab - HEADER_SIZE;
+   u_int32_t offset = (byte *)object - (page + SLAB_HEADER_SIZE);
+   u_int32_t slot = offset / slab_sizes[slab->size_class];
+
+   // Check that the slot to be freed is valid:
+   if ((byte *)object < page + SLAB_HEADER_SIZE
+      || offset % slab_sizes[slab->size_class] != 0
+      || slot >= slab->n_slots
+      || (slab->free_slots[slot / 64] & (1ull << (slot % 64)))) {
+      fprintf(stderr, "Attempt to free non-allocated memory");
+      abort();
+   }
+
+   slab->free_slots[slot / 64] |= 1ull << (slot % 64);
+   slab->n_free++;
+   if (slab->n_free == 1) {
+      pushSlab(a, slab);
+   }
+
+   // An empty slab goes back to the buddy blocks, unless it is the
+   // only one left for its class, so that alternating alloc/free of
+   // one small object doesn't split and merge a slab every time.
+   if (slab->n_free == slab->n_slots
+      && slab->next != (vlink_t)((byte *)slab - a->memory)) {
+      unlinkSlab(a, slab);
+      setSlabPage(a, page, 0);
+      buddyFree(a, page + whatHeaderSize(a));
+   }
+}
+
+// Function that returns the slab header of the slab object lies in,
+// or NULL if object is not in a slab.
+slab_header_t *whatSlab(arena_t *a, void *object) {
+   if (a->slab_pages == NULL) {
+      return NULL;
+   }
+   vaddr_t page = ((byte *)object - a->memory) / SLAB_SIZE;
+   if (!(a->slab_pages[page / 64] & (1ull << (page % 64)))) {
+      return NULL;
+   }
+   return (slab_header_t *)(a->memory + page * SLAB_SIZE + HEADER_SIZE);
+}
+
+// Gives the empty slabs kept for each class back to the buddy blocks.
+// Returns the number of slabs released.
+int releaseSlabs(arena_t *a) {
+   int released = 0;
+   u_int32_t class;
+   for (class = 0; class < SLAB_CLASSES; class++) {
+      if (!(a->slab_partial & (1u << class))) {
+         continue;
+      }
+      slab_header_t *slab = (slab_header_t *)(a->memory + a->slab_lists[class]);
+      if (slab->n_free == slab->n_slots) {
+         byte *page = (byte *)slab - HEADER_SIZE;
+         unlinkSlab(a, slab);
+         setSlabPage(a, page, 0);
+         buddyFree(a, page + whatHeaderSize(a));
+         released++;
+      }
+   }
+   return released;
+}
+
+// Function that works out where the sections of a persistent arena of
+// the given size go in its file, and returns the total file size.
+size_t whatPersistLayout(vsize_t size, size_t *metaAt, size_t *slabAt,
+                         size_t *memAt) {
+   size_t at = PAGE_SIZE_MIN;      // after the header page
+   if (metaAt != NULL) {
+      *metaAt = at;
+   }
+   at += ((size >> MIN_ORDER) + PAGE_SIZE_MIN - 1) & ~(PAGE_SIZE_MIN - 1);
+   if (slabAt != NULL) {
+      *slabAt = at;
+   }
+   if (size >= SLAB_MIN_ARENA) {
+      at += (whatSlabPagesSize(size) + PAGE_SIZE_MIN - 1)
+         & ~(PAGE_SIZE_MIN - 1);
+   }
+   if (memAt != NULL) {
+      *memAt = at;
+   }
+   return at + size;
+}
+
+// Copies a's list heads from the arena to its persist header.
+void persistSave(arena_t *a) {
+   persist_header_t *h = a->persist;
+   u_int32_t i;
+   for (i = 0; i < MAX_ORDERS; i++) {
+      h->free_lists[i] = a->free_lists[i];
+   }
+   h->free_orders = a->free_orders;
+   for (i = 0; i < SLAB_CLASSES; i++) {
+      h->slab_lists[i] = a->slab_lists[i];
+   }
+   h->slab_partial = a->slab_partial;
+}
+
+// Copies a's list heads from its persist header to the arena.
+void persistLoad(arena_t *a) {
+   persist_header_t *h = a->persist;
+   u_int32_t i;
+   for (i = 0; i < MAX_ORDERS; i++) {
+      a->free_lists[i] = h->free_lists[i];
+   }
+   a->free_orders = h->free_orders;
+   for (i = 0; i < SLAB_CLASSES; i++) {
+      a->slab_lists[i] = h->slab_lists[i];
+   }
+   a->slab_partial = h->slab_partial;
+
+   // The counters are not kept in the file, so count the free blocks
+   // and the objects still allocated again; the others start afresh.
+   memset(a->free_counts, 0, sizeof(a->free_counts));
+   a->live = a->splits = a->merges = a->requested = a->granted = 0;
+   for (i = 0; i < MAX_ORDERS; i++) {
+      if (!(a->free_orders & (1ull << i))) {
+         continue;
+      }
+      vaddr_t index = a->free_lists[i];
+      do {
+         a->free_counts[i]++;
+         index = whatAddress(a, index)->next;
+      } while (index != a->free_lists[i]);
+   }
+   // A slab is one block in use, but holds as many objects as it has
+   // slots taken.
+   vaddr_t index = 0;
+   while (index < a->memory_size) {
+      byte meta = a->block_meta[index >> MIN_ORDER];
+      if (meta & META_ALLOC) {
+         slab_header_t *slab = whatSlab(a, a->memory + index);
+         a->live += (slab != NULL) ? slab->n_slots - slab->n_free : 1;
+      }
+      index += whatSize(meta & META_ORDER);
+   }
+}
+
+// Sets or clears the slab_pages bit for the page starting at page.
+void setSlabPage(arena_t *a, byte *page, int isSlab) {
+   vaddr_t p = (page - a->memory) / SLAB_SIZE;
+   if (isSlab) {
+      a->slab_pages[p / 64] |= 1ull << (p % 64);
+   } else {
+      a->slab_pages[p / 64] &= ~(1ull << (p % 64));
+   }
+}
+
+// Adds the slab to the partial list for its class.
+void pushSlab(arena_t *a, slab_header_t *slab) {
+   u_int32_t class = slab->size_class;
+   vlink_t index = (byte *)slab - a->memory;
+
+   if (!(a->slab_partial & (1u << class))) {
+      slab->next = index;
+      slab->prev = index;
+      a->slab_partial |= (1u << class);
+   } else {
+      slab_header_t *head = (slab_header_t *)(a->memory + a->slab_lists[class]);
+      slab_header_t *headPrev = (slab_header_t *)(a->memory + head->prev);
+      slab->next = a->slab_lists[class];
+      slab->prev = head->prev;
+      headPrev->next = index;
+      head->prev = index;
+   }
+   a->slab_lists[class] = index;
+}
+
+// Removes the slab from the partial list for its class.
+void unlinkSlab(arena_t *a, slab_header_t *slab) {
+   u_int32_t class = slab->size_class;
+   vlink_t index = (byte *)slab - a->memory;
+
+   if (slab->next == index) {
+      a->slab_partial &= ~(1u << class);
+      return;
+   }
+   ((slab_header_t *)(a->memory + slab->next))->prev = slab->prev;
+   ((slab_header_t *)(a->memory + slab->prev))->next = slab->next;
+   if (a->slab_lists[class] == index) {
+      a->slab_lists[class] = slab->next;
+   }
+}
+
+
+// Miscellaneous functions below:
+
+// Function to test if x is a power of two.
+int isPowerOfTwo (vsize_t x) {
+  return ((x != 0) && !(x & (x - 1)));
+}
+
+// Function that takes in an integer and returns 
+// the closest power of two that is higher than it.
+vsize_t whatPowerUp(vsize_t n) {
+   if (n <= 1) {
+      return 1;
+   }
+   return (vsize_t)1 << (64 - __builtin_clzll((u_int64_t)n - 1));
+}
+
+// Function that returns the order (log2) of a power-of-two block size.
+u_int32_t whatOrder(vsize_t size) {
+   return __builtin_ctzll(size);
+}
+
+// Function that returns the order of the smallest block that can hold
+// n bytes.
+u_int32_t whatOrderUp(size_t n) {
+   if (n <= whatSize(MIN_ORDER)) {
+      return MIN_ORDER;
+   }
+   return 64 - __builtin_clzll(n - 1);
+}
+
+// Function that returns the size of a block of the given order.
+vsize_t whatSize(u_int32_t order) {
+   return (vsize_t)1 << order;
+}
+
+// Function that returns the # bytes in front of the data in an
+// allocated block of a: a header, or nothing for VLAD_NO_HEADERS arenas.
+u_int32_t whatHeaderSize(arena_t *a) {
+   return (a->flags & VLAD_NO_HEADERS) ? 0 : HEADER_SIZE;
+}
+
+// Function that returns the memory[] index of the block whose data
+// object points to.
+vaddr_t whatBlock(arena_t *a, void *object) {
+   // Aligned data may sit past the block's own header, behind a second
+   // one saying how far (see arenaMemalign).
+   free_header_t *placed = (free_header_t *)((byte *)object - HEADER_SIZE);
+   if (whatHeaderSize(a) != 0 && placed->magic == MAGIC_ALIGNED) {
+      object = (byte *)object - placed->size;
+   }
+   return (byte *)object - a->memory - whatHeaderSize(a);
+}
+
+// Records the order and state of the block at index in a->block_meta.
+void setMeta(arena_t *a, vaddr_t index, u_int32_t order, int allocated) {
+   a->block_meta[index >> MIN_ORDER] = order | (allocated ? META_ALLOC : 0);
+}
+
+// Function that returns the memory[] index of a given pointer to a header.
+vlink_t whatIndex(arena_t *a, free_header_t *ptr) {
+   vlink_t index = (vlink_t)((byte*)ptr - a->memory);
+   return index;
+}
+
+// Function that return the address of a given memory[] index.
+free_header_t *whatAddress(arena_t *a, vaddr_t index) {
+   free_header_t *ptr = (free_header_t *)(a->memory + index);
+   return ptr;
+}
+
+// Function that returns the arena the calling thread allocates from,
+// assigning the thread one round-robin on its first call for this heap.
+arena_t *whatArena(void) {
+   if (thread_arena < 0 || thread_generation != heap_generation) {
+      thread_arena = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED)
+         % n_arenas;
+      thread_generation = heap_generation;
+   }
+   return &arenas[thread_arena];
+}
+
+// Function that returns the arena whose memory object lies in, or NULL
+// if it is not in one of arenas[] (it may be in a region).
+arena_t *whatOwner(void *object) {
+   size_t offset = (byte *)object - memory;
+   if (offset >= (size_t)n_arenas * memory_size) {
+      return NULL;
+   }
+   return &arenas[offset / memory_size];
+}
+
+// Function that returns the region object lies in, or NULL if none.
+// regions_lock must be held.
+arena_t *whatRegion(void *object) {
+   int lo = 0;
+   int hi = n_regions;
+   while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      arena_t *r = regions[mid];
+      if ((byte *)object < r->memory) {
+         hi = mid;
+      } else if ((byte *)object >= r->memory + r->memory_size) {
+         lo = mid + 1;
+      } else {
+         return r;
+      }
+   }
+   return NULL;
+}
+
+// Marks the block ptr is pointing to as free and adds it
+// to the free list for its order.
+void pushFree(arena_t *a, free_header_t *ptr) {
+   u_int32_t order = whatOrder(ptr->size);
+
+   ptr->magic = MAGIC_FREE;
+   setMeta(a, whatIndex(a, ptr), order, 0);
+   a->free_counts[order]++;
+   if (a->position_bits != NULL) {
+      setPositionBit(a, whatIndex(a, ptr), order, 1);
+   }
+   if (!(a->free_orders & (1ull << order))) {
+      ptr->next = whatIndex(a, ptr);
+      ptr->prev = whatIndex(a, ptr);
+      a->free_orders |= (1ull << order);
+   } else {
+      free_header_t *head = whatAddress(a, a->free_lists[order]);
+      free_header_t *headPrev = whatAddress(a, head->prev);
+      ptr->next = whatIndex(a, head);
+      ptr->prev = head->prev;
+      headPrev->next = whatIndex(a, ptr);
+      head->prev = whatIndex(a, ptr);
+   }
+   a->free_lists[order] = whatIndex(a, ptr);
+}
+
+// Removes the block ptr is pointing to from the free list for its order.
+void unlinkFree(arena_t *a, free_header_t *ptr) {
+   u_int32_t order = whatOrder(ptr->size);
+
+   a->free_counts[order]--;
+   if (a->position_bits != NULL) {
+      setPositionBit(a, whatIndex(a, ptr), order, 0);
+   }
+   if (ptr->next == whatIndex(a, ptr)) {
+      a->free_orders &= ~(1ull << order);
+      return;
+   }
+   whatAddress(a, ptr->next)->prev = ptr->prev;
+   whatAddress(a, ptr->prev)->next = ptr->next;
+   if (a->free_lists[order] == whatIndex(a, ptr)) {
+      a->free_lists[order] = ptr->next;
+   }
+}
+
+// Sets or clears the position bit of the block of the given order at
+// index, for VLAD_ADDRESS_ORDER arenas.
+void setPositionBit(arena_t *a, vaddr_t index, u_int32_t order, int isFree) {
+   vaddr_t bit = index >> order;
+   u_int64_t *word = &a->free_bits[order][bit / 64];
+   u_int64_t *summary = &a->free_summary[order][bit / 4096];
+   if (isFree) {
+      *word |= 1ull << (bit % 64);
+      *summary |= 1ull << (bit / 64 % 64);
+   } else {
+      *word &= ~(1ull << (bit % 64));
+      if (*word == 0) {
+         *summary &= ~(1ull << (bit / 64 % 64));
+      }
+   }
+}
+
+// Function that returns the memory[] index of the free block of the
+// given order to allocate next: the lowest one for VLAD_ADDRESS_ORDER
+// arenas, else the head of its free list.
+vaddr_t whatFirstFree(arena_t *a, u_int32_t order) {
+   if (a->position_bits == NULL) {
+      return a->free_lists[order];
+   }
+   // The list is not empty, so neither are the bitmaps.
+   size_t words = ((a->memory_size >> order) + 63) / 64;
+   size_t j = whatNonZeroWord(a->free_summary[order], (words + 63) / 64);
+   size_t w = j * 64 + __builtin_ctzll(a->free_summary[order][j]);
+   size_t bit = w * 64 + __builtin_ctzll(a->free_bits[order][w]);
+   return (vaddr_t)bit << order;
+}
+
+// Function that returns the index of the first non-zero word of words,
+// or count if there is none.
+size_t whatNonZeroWord(const u_int64_t *words, size_t count) {
+   // Skip zero words several at a time where the CPU allows, then find
+   // the exact one among the last few.
+   size_t i = 0;
+#if defined(__AVX2__)
+   for (; i + 4 <= count; i += 4) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(words + i));
+      if (!_mm256_testz_si256(v, v)) {
+         break;
+      }
+   }
+#elif defined(__SSE4_1__)
+   for (; i + 2 <= count; i += 2) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(words + i));
+      if (!_mm_testz_si128(v, v)) {
+         break;
+      }
+   }
+#elif defined(__SSE2__)
+   for (; i + 2 <= count; i += 2) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(words + i));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()))
+         != 0xffff) {
+         break;
+      }
+   }
+#endif
+   while (i < count && words[i] == 0) {
+      i++;
+   }
+   return i;
+}
+
+// Function that splits the block of memory ptr is pointing to
+// into two equal-sized blocks, returning a pointer to the new block
+// at the halfway point. The new block is put on its free list.
+free_header_t *insertHalve(arena_t *a, free_header_t *ptr) {
+
+   free_header_t *newHeader = (free_header_t*)((byte*)ptr+(ptr->size/2));
+
+   // Reassign ptr header variables:
+   ptr->size = ptr->size/2;
+   a->splits++;
+   newHeader->size = ptr->size;
+   pushFree(a, newHeader);
+
+   // Both halves of a zero block are zero past their headers; the upper
+   // half of any other has been free as long as the whole.
+   if (a->block_meta[whatIndex(a, ptr) >> MIN_ORDER] & META_ZERO) {
+      a->block_meta[whatIndex(a, newHeader) >> MIN_ORDER] |= META_ZERO;
+   } else if (newHeader->size >= whatSize(PURGE_MIN_ORDER)) {
+      *whatFreeTime(newHeader) = *whatFreeTime(ptr);
+   }
+
+         //printf("newHeader size is: %d at %p\n", newHeader->size, newHeader);
+
+   return newHeader;
+
+}
+
+// Determines if memory block is a valid FREE block;
+int magicFreeOK(free_header_t *header) {
+   return (header->magic == MAGIC_FREE);
+}
+
+// Determines if memory block is a valid ALLOCATED block;
+int magicAllocOK(free_header_t *header) {
+   return (header->magic == MAGIC_ALLOC || header->magic == MAGIC_MARKED);
+}
+
+// Returns the free buddy of the block ptr is pointing to,
+// or NULL if its buddy is not currently free and whole.
+free_header_t *findBuddy(arena_t *a, free_header_t *ptr) {
+   if (ptr->size == a->memory_size) {
+      return NULL;
+   }
+
+   // A block's buddy is the other half of the block it was split
+   // from, so it sits at the index with the size bit flipped. That
+   // index is always the start of a block: either the whole buddy,
+   // or the first piece of it if it has been split since, so its
+   // metadata byte says whether the whole buddy is free.
+   vaddr_t buddyIndex = whatIndex(a, ptr) ^ ptr->size;
+   byte meta = a->block_meta[buddyIndex >> MIN_ORDER];
+   if (!(meta & META_ALLOC) && (meta & META_ORDER) == whatOrder(ptr->size)) {
+      return whatAddress(a, buddyIndex);
+   }
+   return NULL;
 }
 
 
@@ -588,6 +3798,9 @@ void vlad_reveal(void *alpha[26])
     char label[3]; // letters for used memory, numbers for free memory
     int free_count, alloc_count, max_count;
     free_header_t * block;
+    byte *memory = arenas[0].memory;       // only the first arena is shown
+    vsize_t memory_size = arenas[0].memory_size;
+    flushQuick(&arenas[0]);   // show blocks on quick lists as free
 
 	// TODO
 	// REMOVE these statements when your vlad_malloc() is done
@@ -608,7 +3821,7 @@ void vlad_reveal(void *alpha[26])
         block = (free_header_t *)(memory + offset);
         if (block->magic == MAGIC_FREE) {
             snprintf(free_sizes[free_count++], 32, 
-                "%d) %d bytes", i, block->size);
+                "%d) %lu bytes", i, (unsigned long)block->size);
             snprintf(label, 3, "%d", i++);
             fill_block(graph, offset,label);
         }
@@ -622,7 +3835,7 @@ void vlad_reveal(void *alpha[26])
             offset = ((byte *) alpha[i] - (byte *) memory) - HEADER_SIZE;
             block = (free_header_t *)(memory + offset);
             snprintf(alloc_sizes[alloc_count++], 32, 
-                "%c) %d bytes", 'a' + i, block->size);
+                "%c) %lu bytes", 'a' + i, (unsigned long)block->size);
             snprintf(label, 3, "%c", 'a' + i);
             fill_block(graph, offset,label);
         }
@@ -658,6 +3871,8 @@ static void fill_block(char graph[STAT_HEIGHT][STAT_WIDTH][20],
     free_header_t * block;
     char * color;
     char text[3];
+    byte *memory = arenas[0].memory;
+    vsize_t memory_size = arenas[0].memory_size;
     block = (free_header_t *)(memory + offset);
     start = offset_to_point(offset, memory_size, 0);
     end = offset_to_point(offset + block->size, memory_size, 1);
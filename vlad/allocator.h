@@ -12,6 +12,76 @@
 
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// An arena is an independent heap. The functions below that take no
+// arena work on a default set of arenas set up by vlad_init().
+
+typedef struct vlad_arena vlad_arena_t;
+
+// A point to rewind an arena to: see vlad_arena_mark().
+typedef struct vlad_mark vlad_mark_t;
+
+// Figures filled in by vlad_get_stats(). Bytes in use count whole
+// blocks, so they include headers, slabs and rounding up; internal
+// fragmentation is the part of the usable bytes given out so far that
+// was not asked for, and external fragmentation the part of the free
+// bytes not in the largest free block.
+struct vlad_stats {
+   size_t heap_bytes;             // bytes in all arenas and regions
+   size_t used_bytes;             // bytes in blocks in use
+   size_t free_bytes;             // bytes in free blocks
+   size_t used_objects;           // objects allocated and not yet freed
+   size_t free_blocks[64];        // free blocks of 2^order bytes, by order
+   size_t largest_free;           // bytes in the largest free block
+   size_t huge_bytes;             // bytes mapped for huge blocks, which
+                                  // count as heap and in use too
+   unsigned long long splits;     // blocks halved so far
+   unsigned long long merges;     // buddy pairs merged so far
+   unsigned long long failed;     // allocations that returned NULL so far
+   unsigned long long requested;  // bytes asked for so far
+   unsigned long long granted;    // usable bytes given for them
+   unsigned long long purged;     // free bytes given back to the OS so far
+   double internal_frag;          // 1 - requested / granted
+   double external_frag;          // 1 - largest_free / free_bytes
+};
+
+// Flags for vlad_arena_create_flags():
+//
+// VLAD_NO_HEADERS - allocated blocks carry no header; their size and
+//                   state are kept only in a side table, so data starts
+//                   on the block boundary and a 2^k-byte request fits a
+//                   2^k-byte block exactly
+// VLAD_HUGE_PAGES - ask the OS to back the arena with transparent huge
+//                   pages where it can
+// VLAD_LAZY       - freed blocks of up to 64KB are kept whole on a short
+//                   list per size and handed straight back out; they
+//                   are only merged with their buddies once that list
+//                   is full or a request cannot otherwise be met
+// VLAD_ADDRESS_ORDER - of the free blocks of the best-fitting size, use
+//                   the lowest-addressed, found through a bitmap of free
+//                   positions per size, so that what is in use packs
+//                   toward the start of the arena
+//
+// The arenas of vlad_init_threads() are VLAD_LAZY | VLAD_ADDRESS_ORDER.
+
+#define VLAD_NO_HEADERS    0x1
+#define VLAD_HUGE_PAGES    0x2
+#define VLAD_LAZY          0x4
+#define VLAD_ADDRESS_ORDER 0x8
+
+// Bytes in the header in front of each buddy block of an arena without
+// VLAD_NO_HEADERS, so that the block a request needs can be worked out
+// ahead of time (see vlad_arena_malloc_order()).
+
+#ifdef VLAD_SMALL_HEADERS
+#define VLAD_HEADER_SIZE   16
+#else
+#define VLAD_HEADER_SIZE   32
+#endif
+
 // Input: size - number of bytes to make available to the allocator
 // Output: none              
 // Precondition: Size is a power of two.
@@ -20,17 +90,54 @@
 // (If the allocator is already initialised, this function does nothing,
 //  even if it was initialised with different size)
 
-void vlad_init(u_int32_t size);
+void vlad_init(size_t size);
+
+// Input: size - number of bytes in each arena
+//        n - number of arenas, or <= 0 for one per online CPU
+// Output: none
+// Precondition: Size is a power of two.
+// Postcondition: n * size bytes are now available to the allocator,
+//                split into n arenas that can be used concurrently
+//
+// All of the functions below are then safe to call from any thread, and
+// the heap stays usable in the child after a fork().
+// Each thread allocates from its own arena (assigned round-robin) and
+// vlad_free() returns a block to the arena it came from. A block freed
+// by a thread of another arena does not take that arena's lock: it is
+// queued with one atomic operation, and the queue is freed in one batch
+// the next time the arena allocates.
+// vlad_init(size) is the same as vlad_init_threads(size, 1).
+//
+// Arena memory is mapped straight from the OS without being committed;
+// pages only take up physical memory once blocks in them are used, so
+// setting up even a very large arena takes constant time.
+//
+// The n arenas are only the starting heap. When none of them can serve
+// a request, another power-of-two region of at least `size` bytes (or
+// big enough for the request) is mapped and used as well, and a region
+// is unmapped again once everything in it is freed, so the heap grows
+// and shrinks with the load.
+//
+// Huge requests, of 128KB or more and over a quarter of `size`, are not
+// taken from the arenas at all: each is mapped on its own and unmapped
+// when freed, so that it neither splits up an arena's big blocks nor
+// keeps its memory once it is gone.
+
+void vlad_init_threads(size_t size, int n);
 
 // Input: n - number of bytes requested
 // Output: p - a pointer, or NULL
 // Precondition: n is < size of memory available to the allocator
-// Postcondition: If a region of size n or greater cannot be found, p = NULL 
+// Postcondition: If a region of size n or greater cannot be found, even
+//                by growing the heap, p = NULL
 //                Else, p points to a location immediately after a header block
 //                      for a newly-allocated region of some size >= 
-//                      n + header size. 
+//                      n + header size.
+//                Requests of up to 64 bytes in arenas of 64KB or more
+//                are served from headerless slab slots instead, and
+//                huge ones from a mapping of their own.
 
-void *vlad_malloc(u_int32_t n);
+void *vlad_malloc(size_t n);
 
 // Input: object, a pointer.
 // Output: none
@@ -41,12 +148,334 @@ void *vlad_malloc(u_int32_t n);
 
 void vlad_free(void *object);
 
+// Input: object - a pointer, or NULL
+//        n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Precondition: object is NULL or was returned by vlad_malloc()
+// Postcondition: p points to a region of at least n bytes holding the
+//                first n bytes of object's region (or all of it, if it
+//                was smaller). The region is resized in place when it
+//                can be, and moved otherwise. If it cannot be resized,
+//                p = NULL and object is untouched. vlad_realloc(NULL, n)
+//                is vlad_malloc(n); vlad_realloc(object, 0) frees object
+//                and returns NULL.
+
+void *vlad_realloc(void *object, size_t n);
+
+// Input: count - number of objects, size - bytes in each object
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_malloc(count * size), but every byte of
+//                the region is zero. Blocks that have not been written
+//                since the arena was set up are not cleared again.
+
+void *vlad_calloc(size_t count, size_t size);
+
+// Input: alignment - a power of two, n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_malloc(n), but p is a multiple of
+//                alignment. p = NULL if alignment is not a power of two.
+//                The region can be freed and resized as any other, but
+//                a region that moves on resizing loses its alignment.
+//                Arenas without headers hand out a block of exactly the
+//                alignment's size for small requests, wasting nothing.
+
+void *vlad_memalign(size_t alignment, size_t n);
+
+// Input: alignment - a power of two, n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_memalign(alignment, n)
+
+void *vlad_aligned_alloc(size_t alignment, size_t n);
+
+// Input: object - a pointer
+// Output: 1 if object lies in memory vlad_malloc() and friends hand out
+//         from, else 0
+
+int vlad_owns(void *object);
+
+// Input: object - a pointer
+// Precondition: object was returned by vlad_malloc() and friends
+// Output: the # bytes that can be used at object, at least as many as
+//         were asked for
+
+size_t vlad_usable_size(void *object);
+
+// Input: n - number of bytes in each object
+//        count - number of objects requested
+//        objects - array of at least count pointers
+// Output: the number of objects allocated, at most count
+// Postcondition: objects[0 .. result-1] are as if each came from
+//                vlad_malloc(n); fewer than count means memory ran out.
+//                Carving many blocks at once is cheaper than count calls.
+
+int vlad_malloc_batch(size_t n, int count, void **objects);
+
+// Input: objects - array of pointers, count - number of them
+// Precondition: each object was returned by vlad_malloc() and friends
+// Postcondition: every object is freed, as by vlad_free(). Neighbouring
+//                blocks in the batch are merged with each other first.
+//                The contents of objects[] are left unspecified.
+
+void vlad_free_batch(void **objects, int count);
+
+// Output: the # bytes given back to the OS
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: every free block of 64KB or more in the heap has had
+//                its pages given back to the OS but the first, as have
+//                all free regions but one
+//
+// Blocks left free for a second are given back anyway, as the arena
+// they are in goes on being used; this does it for all of them now.
+// The pages come back, zero, when next touched.
+
+size_t vlad_purge(void);
+
+// Precondition: allocator has been vlad_init()'d, and no other thread
+//               is using it
+// Postcondition: every arena is one free block again, as vlad_init()
+//                left it, every region is given back to the OS but one,
+//                which is emptied too, and every huge block is unmapped;
+//                everything allocated is gone.
+//                Takes the same time however many blocks there were.
+
+void vlad_reset(void);
+
+// Output: mark - a mark, or NULL
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: as for vlad_arena_mark(), on the arena the calling
+//                thread allocates from. Huge blocks, and blocks the
+//                thread gets from a region once that arena is full, are
+//                not covered.
+//
+// Threads are handed the heap's arenas in turn, so once there are more
+// threads than arenas, some share one. The mark then covers whatever
+// the other threads on that arena allocate too, and vlad_rewind() frees
+// their blocks while they are still in use. Only mark the default heap
+// in a program with no more threads than vlad_init_threads() was given
+// arenas; otherwise use an arena of your own (vlad_arena_mark()).
+// While a mark is set, small requests take buddy blocks rather than
+// slab slots, as for vlad_arena_mark().
+
+vlad_mark_t *vlad_mark(void);
+
+// Input: mark - a mark returned by vlad_mark()
+// Postcondition: as for vlad_arena_rewind(), on the arena mark was set in
+
+void vlad_rewind(vlad_mark_t *mark);
+
 // Stop the allocator, so that it can be init'ed again:
 // Precondition: allocator memory was once allocated by vlad_init()
 // Postcondition: allocator is unusable until vlad_int() executed again
 
 void vlad_end(void);
 
+// Input: size - number of bytes to make available to the arena
+// Output: a - a new arena, or NULL if its memory cannot be obtained
+// Precondition: Size is a power of two.
+// Postcondition: `size` bytes are available to vlad_arena_malloc(a, ...)
+//
+// Arenas are independent of vlad_init() and of each other; each has
+// its own lock, so one arena may be shared between threads.
+
+vlad_arena_t *vlad_arena_create(size_t size);
+
+// As vlad_arena_create(), with flags being VLAD_* flags or'ed together.
+
+vlad_arena_t *vlad_arena_create_flags(size_t size, int flags);
+
+// Input: a - an arena, n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_malloc(), but p lies in a's memory
+
+void *vlad_arena_malloc(vlad_arena_t *a, size_t n);
+
+// Input: a - an arena, n - number of bytes requested, order - log2 of
+//        the smallest power of two of at least n + VLAD_HEADER_SIZE
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_arena_malloc(a, n)
+//
+// For callers that know n when they are compiled, as vlad.hpp does, so
+// that no time goes on working out the size of block n needs.
+
+void *vlad_arena_malloc_order(vlad_arena_t *a, size_t n, unsigned order);
+
+// Input: a - an arena, object - a pointer
+// Precondition: object was returned by vlad_arena_malloc(a, ...)
+// Postcondition: The region pointed to by object can be re-allocated by 
+//                vlad_arena_malloc(a, ...)
+
+void vlad_arena_free(vlad_arena_t *a, void *object);
+
+// Input: a - an arena, n - number of bytes in each object
+//        count - number of objects requested
+//        objects - array of at least count pointers
+// Output: the number of objects allocated, at most count
+// Postcondition: as for vlad_malloc_batch(), but in a's memory
+
+int vlad_arena_malloc_batch(vlad_arena_t *a, size_t n, int count,
+                            void **objects);
+
+// Input: a - an arena, objects - array of pointers, count - how many
+// Precondition: each object was returned by vlad_arena_malloc(a, ...)
+// Postcondition: as for vlad_free_batch()
+
+void vlad_arena_free_batch(vlad_arena_t *a, void **objects, int count);
+
+// Input: a - an arena, n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_arena_malloc(), but every byte of p is zero
+
+void *vlad_arena_calloc(vlad_arena_t *a, size_t n);
+
+// Input: a - an arena, alignment - a power of two
+//        n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Postcondition: as for vlad_memalign(), but p lies in a's memory
+
+void *vlad_arena_memalign(vlad_arena_t *a, size_t alignment, size_t n);
+
+// Input: a - an arena, object - a pointer, or NULL
+//        n - number of bytes requested
+// Output: p - a pointer, or NULL
+// Precondition: object is NULL or was returned by vlad_arena_malloc(a, ...)
+// Postcondition: as for vlad_realloc(), but p lies in a's memory
+
+void *vlad_arena_realloc(vlad_arena_t *a, void *object, size_t n);
+
+// Input: a - an arena
+// Precondition: no other thread is using a
+// Postcondition: a is one free block again, as vlad_arena_create() left
+//                it; everything allocated from it is gone. Takes the
+//                same time however many blocks were in it.
+
+void vlad_arena_reset(vlad_arena_t *a);
+
+// Input: a - an arena
+// Output: the # bytes given back to the OS
+// Postcondition: as for vlad_purge(), but of a alone (and nothing, if a
+//                is persistent)
+
+size_t vlad_arena_purge(vlad_arena_t *a);
+
+// Input: a - an arena
+// Output: mark - a mark, or NULL if a has no room for one or is
+//         persistent or VLAD_NO_HEADERS
+// Postcondition: vlad_arena_rewind(a, mark) will free every block
+//                allocated from a after this, and not yet freed
+//
+// Marks nest. While any is set, each allocation from a costs a few more
+// stores, and requests slabs would serve (up to 64 bytes) get buddy
+// blocks of their own, header and all: an 8-byte request takes a 32- or
+// 64-byte block (by header size) rather than an 8-byte slab slot.
+
+vlad_mark_t *vlad_arena_mark(vlad_arena_t *a);
+
+// Input: a - an arena, mark - a mark
+// Precondition: mark was returned by vlad_arena_mark(a) and has not been
+//               rewound to, nor a mark set before it
+// Postcondition: every block allocated from a since mark was set is
+//                freed, as by vlad_arena_free(); so are mark and any
+//                marks set after it, which cannot be used again
+
+void vlad_arena_rewind(vlad_arena_t *a, vlad_mark_t *mark);
+
+// Input: a - an arena
+// Precondition: a was returned by vlad_arena_create()
+// Postcondition: a and every block still allocated from it are released
+//                in one go; none of its pointers may be used again
+//                (a persistent arena is closed, as by
+//                vlad_close_persistent(), and its file kept)
+
+void vlad_arena_destroy(vlad_arena_t *a);
+
+// Input: path - file to keep the arena in
+//        size - number of bytes to make available, for a new file
+// Output: a - the arena, or NULL if the file cannot be used
+// Postcondition: If path is new or empty, it now holds an empty arena of
+//                `size` bytes (rounded up to a power of two). Otherwise
+//                the arena already in it is reattached as it was left,
+//                with every allocation still in place, and size is
+//                ignored. If the file was not closed cleanly the arena
+//                in it cannot be trusted, so it is emptied instead.
+//
+// The file is mapped, not read, so reattaching takes constant time and
+// pages are only read in as they are used. The mapping may land at a
+// different address each time, so data in the arena should refer to
+// other data in it by offset from the root (see vlad_set_root()).
+// Files are only compatible between builds with the same header size.
+
+vlad_arena_t *vlad_open_persistent(const char *path, size_t size);
+
+// Input: a - an arena
+// Precondition: a was returned by vlad_open_persistent()
+// Postcondition: a's state is written back and marked clean in its file,
+//                which stays as it is for the next vlad_open_persistent()
+
+void vlad_close_persistent(vlad_arena_t *a);
+
+// Input: a - a persistent arena, object - a pointer from it, or NULL
+// Postcondition: vlad_get_root(a) returns object, in this and later
+//                openings of the file (at the address it maps to then)
+
+void vlad_set_root(vlad_arena_t *a, void *object);
+
+// Input: a - a persistent arena
+// Output: the object last given to vlad_set_root(a, ...), or NULL
+
+void *vlad_get_root(vlad_arena_t *a);
+
+// Input: a - an arena, fd - a file descriptor open for writing
+// Output: 0, or -1 if writing failed
+// Postcondition: as for vlad_snapshot(), but of a alone
+
+int vlad_arena_snapshot(vlad_arena_t *a, int fd);
+
+// Input: stats - where to put the figures
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: *stats describes the heap as it is now, and what it
+//                has done since vlad_init()
+//
+// Every figure is a counter kept up to date as blocks come and go, so
+// this takes time in proportion to the number of orders and arenas,
+// not of blocks, and is cheap enough to poll on a live heap.
+
+void vlad_get_stats(struct vlad_stats *stats);
+
+// Input: path - file to record into, records - # records to keep
+// Output: 0, or -1 if the file cannot be set up
+// Precondition: no other thread is using the allocator
+// Postcondition: from now until vlad_trace_stop(), each call of
+//                vlad_malloc(), vlad_free(), vlad_realloc(),
+//                vlad_calloc(), vlad_memalign() and the batch functions
+//                is recorded in path, which is created or emptied. Only
+//                the latest `records` records are kept.
+//
+// Records are written straight into a shared mapping of the file, so
+// recording costs a clock read and a few stores per call. The format
+// is described in trace.h; replay.c replays a trace against vlad.
+
+int vlad_trace_start(const char *path, size_t records);
+
+// Precondition: no other thread is using the allocator
+// Postcondition: recording started by vlad_trace_start() is finished,
+//                and its file complete
+
+void vlad_trace_stop(void);
+
+// Input: fd - a file descriptor open for writing
+// Output: 0, or -1 if writing failed
+// Precondition: allocator has been vlad_init()'d
+// Postcondition: a map of every block of every arena and region (where
+//                it is, its size, and whether it is free, in use, a slab
+//                or waiting on a quick list) has been written to fd
+//
+// Blocks are written as runs of alike neighbours, in the format of
+// snapshot.h, and each arena's lock is only held for a few thousand
+// blocks at a time, so even a heap of many GB can be mapped while in
+// use. heapmap.c summarises and draws a snapshot.
+
+int vlad_snapshot(int fd);
+
 // Precondition: allocator has been vlad_init()'d
 // Postcondition: allocator stats displayed on stdout
 
@@ -57,4 +486,8 @@ void vlad_stats(void);
 
 void vlad_reveal(void **);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,461 @@
+//
+// Vlad: the memory allocator
+// bench.c ... compare vlad against the C library's malloc
+//
+// Build:   gcc -O2 -o bench bench.c allocator.c -lpthread
+// Usage:   ./bench [-a vlad|libc|both] [-w workload] [-d uniform|powerlaw]
+//                  [-n ops] [-t threads] [-m min] [-M max] [-L live]
+//                  [-H arena bytes] [-s seed]
+//
+// Each workload is run once per allocator, each run in a child process
+// of its own so that the peak RSS of one does not hide the other's.
+// A line is printed per run giving throughput, the latency of single
+// malloc/free calls, peak RSS and how much RSS there was per byte live.
+//
+// Workloads (-w, default all of them):
+//    lifo     ... allocate L objects, free them newest first, repeat
+//    fifo     ... allocate L objects, free them oldest first, repeat
+//    random   ... allocate L objects, free them in random order, repeat
+//    prodcons ... half the threads allocate, and hand each object to a
+//                 partner thread that frees it
+//    churn    ... keep L objects live, replacing a random one each step,
+//                 for a long-running mix of sizes that fragments the heap
+// Sizes (-d) are uniform in [min, max], or a power law (many small, a
+// few large) over the same range.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sched.h>
+
+#include "allocator.h"
+
+#define RING_SIZE 4096  // objects in flight between a producer/consumer
+
+typedef struct allocator {
+   const char *name;
+   void (*init)(size_t size, int threads);
+   void *(*malloc)(size_t n);
+   void (*free)(void *object);
+} allocator_t;
+
+typedef struct options {
+   long ops;            // malloc + free calls per thread
+   int threads;
+   size_t min, max;     // object sizes
+   int powerlaw;        // size distribution, else uniform
+   long live;           // objects live at once per thread
+   size_t heap;         // vlad arena size
+   unsigned long seed;
+} options_t;
+
+// What one thread did, and how long each call took.
+typedef struct worker {
+   const allocator_t *alloc;
+   const options_t *opt;
+   const char *workload;
+   int id;
+   unsigned long long rng;
+   unsigned int *lat;   // ns per call, one entry per call made
+   long n_lat;
+   long failed;
+   size_t live, peak_live;
+
+   // prodcons: the ring this thread shares with its partner
+   void **ring;
+   volatile long *head, *tail;
+} worker_t;
+
+static void libcInit(size_t size, int threads) { (void)size; (void)threads; }
+static void vladInit(size_t size, int threads) { vlad_init_threads(size, threads); }
+
+static const allocator_t allocators[] = {
+   {"vlad", vladInit, vlad_malloc, vlad_free},
+   {"libc", libcInit, malloc, free},
+};
+
+static const char *workloads[] = {"lifo", "fifo", "random", "prodcons", "churn"};
+
+#define N_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+#define N_WORKLOADS  (sizeof(workloads) / sizeof(workloads[0]))
+
+// Functions prototypes:
+
+// Runs workload w with alloc in a child process and prints its results.
+void runOne(const allocator_t *alloc, const char *w, const options_t *opt);
+
+// Thread bodies for each workload.
+void *runPattern(void *arg);
+void *runProducer(void *arg);
+void *runConsumer(void *arg);
+void *runChurn(void *arg);
+
+// Times one malloc or free, keeping the latency and live byte count.
+void *timedMalloc(worker_t *w, size_t n);
+void timedFree(worker_t *w, void *object, size_t n);
+
+// Function that returns a pseudo-random number (xorshift64*).
+unsigned long long whatRandom(worker_t *w);
+
+// Function that returns the size of the next object to allocate.
+size_t whatObjectSize(worker_t *w);
+
+// Function that returns the monotonic clock in ns.
+unsigned long long whatTime(void);
+
+// Orders latencies, for qsort().
+int compareLatency(const void *x, const void *y);
+
+int main(int argc, char *argv[])
+{
+   options_t opt = {1000000, 1, 16, 4096, 0, 10000, 64 << 20, 1};
+   const char *onlyAlloc = "both";
+   const char *onlyWork = NULL;
+   int c;
+
+   while ((c = getopt(argc, argv, "a:w:d:n:t:m:M:L:H:s:")) != -1) {
+      switch (c) {
+      case 'a': onlyAlloc = optarg; break;
+      case 'w': onlyWork = optarg; break;
+      case 'd': opt.powerlaw = (strcmp(optarg, "powerlaw") == 0); break;
+      case 'n': opt.ops = atol(optarg); break;
+      case 't': opt.threads = atoi(optarg); break;
+      case 'm': opt.min = strtoul(optarg, NULL, 0); break;
+      case 'M': opt.max = strtoul(optarg, NULL, 0); break;
+      case 'L': opt.live = atol(optarg); break;
+      case 'H': opt.heap = strtoul(optarg, NULL, 0); break;
+      case 's': opt.seed = strtoul(optarg, NULL, 0); break;
+      default:
+         fprintf(stderr, "usage: %s [-a vlad|libc|both] [-w workload] "
+            "[-d uniform|powerlaw] [-n ops] [-t threads] [-m min] "
+            "[-M max] [-L live] [-H arena bytes] [-s seed]\n", argv[0]);
+         return 1;
+      }
+   }
+   if (opt.threads < 1 || opt.ops < 2 || opt.live < 1
+      || opt.min < 1 || opt.max < opt.min) {
+      fprintf(stderr, "%s: bad option values\n", argv[0]);
+      return 1;
+   }
+   if (opt.live > opt.ops / 2) {
+      opt.live = opt.ops / 2;
+   }
+
+   printf("%-9s %-5s %-8s %12s %8s %8s %8s %11s %9s\n", "workload",
+      "alloc", "sizes", "ops/s", "p50ns", "p99ns", "p999ns", "peakRSS_KB",
+      "rss/live");
+   unsigned int i, j;
+   for (i = 0; i < N_WORKLOADS; i++) {
+      if (onlyWork != NULL && strcmp(onlyWork, workloads[i]) != 0) {
+         continue;
+      }
+      for (j = 0; j < N_ALLOCATORS; j++) {
+         if (strcmp(onlyAlloc, "both") == 0
+            || strcmp(onlyAlloc, allocators[j].name) == 0) {
+            runOne(&allocators[j], workloads[i], &opt);
+         }
+      }
+   }
+   return 0;
+}
+
+// Runs workload w with alloc in a child process and prints its results.
+void runOne(const allocator_t *alloc, const char *w, const options_t *opt)
+{
+   fflush(stdout);
+   pid_t pid = fork();
+   if (pid < 0) {
+      perror("fork");
+      exit(1);
+   }
+   if (pid > 0) {
+      waitpid(pid, NULL, 0);
+      return;
+   }
+
+   int prodcons = (strcmp(w, "prodcons") == 0);
+   int threads = opt->threads;
+   if (prodcons && threads < 2) {
+      threads = 2;
+   }
+   alloc->init(opt->heap, threads);
+
+   worker_t *workers = calloc(threads, sizeof(worker_t));
+   pthread_t *tids = calloc(threads, sizeof(pthread_t));
+   void **rings = calloc((size_t)threads * RING_SIZE, sizeof(void *));
+   volatile long *ends = calloc((size_t)threads * 2, sizeof(long));
+   int t;
+   for (t = 0; t < threads; t++) {
+      worker_t *wk = &workers[t];
+      wk->alloc = alloc;
+      wk->opt = opt;
+      wk->workload = w;
+      wk->id = t;
+      wk->rng = opt->seed * 0x9E3779B97F4A7C15ull + t + 1;
+      // Fault the latency log in now, so it is not counted in the RSS.
+      wk->lat = malloc(opt->ops * sizeof(unsigned int));
+      memset(wk->lat, 0, opt->ops * sizeof(unsigned int));
+      // Producer t and consumer t + 1 share the ring of the pair.
+      wk->ring = rings + (size_t)(t & ~1) * RING_SIZE;
+      wk->head = &ends[(t & ~1) * 2];
+      wk->tail = &ends[(t & ~1) * 2 + 1];
+   }
+
+   struct rusage ru;
+   getrusage(RUSAGE_SELF, &ru);
+   long baseRss = ru.ru_maxrss;
+   unsigned long long start = whatTime();
+   for (t = 0; t < threads; t++) {
+      void *(*body)(void *) = runPattern;
+      if (prodcons) {
+         body = (t % 2 == 0 && t + 1 < threads) ? runProducer : runConsumer;
+         if (t % 2 == 0 && t + 1 >= threads) {
+            body = runPattern;   // odd one out: no partner
+         }
+      } else if (strcmp(w, "churn") == 0) {
+         body = runChurn;
+      }
+      pthread_create(&tids[t], NULL, body, &workers[t]);
+   }
+   long calls = 0;
+   long failed = 0;
+   size_t peakLive = 0;
+   for (t = 0; t < threads; t++) {
+      pthread_join(tids[t], NULL);
+      calls += workers[t].n_lat;
+      failed += workers[t].failed;
+      peakLive += workers[t].peak_live;
+   }
+   double secs = (whatTime() - start) / 1e9;
+   getrusage(RUSAGE_SELF, &ru);
+
+   // Percentiles over every call made by every thread.
+   unsigned int *all = malloc((calls ? calls : 1) * sizeof(unsigned int));
+   long k = 0;
+   for (t = 0; t < threads; t++) {
+      memcpy(all + k, workers[t].lat, workers[t].n_lat * sizeof(unsigned int));
+      k += workers[t].n_lat;
+   }
+   qsort(all, calls, sizeof(unsigned int), compareLatency);
+   unsigned int p50 = calls ? all[calls / 2] : 0;
+   unsigned int p99 = calls ? all[(long)(calls * 0.99)] : 0;
+   unsigned int p999 = calls ? all[(long)(calls * 0.999)] : 0;
+
+   // The RSS the run added, per byte it had live at most (summed over
+   // threads, so a little high when their peaks do not coincide).
+   long rss = ru.ru_maxrss - baseRss;
+   double frag = peakLive ? (rss * 1024.0) / peakLive : 0;
+
+   printf("%-9s %-5s %-8s %12.0f %8u %8u %8u %11ld", w, alloc->name,
+      opt->powerlaw ? "powerlaw" : "uniform", calls / secs, p50, p99, p999,
+      ru.ru_maxrss);
+   // Objects in flight between threads are not counted live by either.
+   if (prodcons) {
+      printf(" %9s", "-");
+   } else {
+      printf(" %9.2f", frag);
+   }
+   if (failed) {
+      printf("  (%ld failed)", failed);
+   }
+   printf("\n");
+   fflush(stdout);
+   _exit(0);
+}
+
+// lifo/fifo/random: allocate live objects, then free them all in the
+// workload's order, until the thread's calls are used up.
+void *runPattern(void *arg)
+{
+   worker_t *w = arg;
+   const char *order = w->workload;
+   long live = w->opt->live;
+   void **objects = malloc(live * sizeof(void *));
+   size_t *sizes = malloc(live * sizeof(size_t));
+   long *perm = malloc(live * sizeof(long));
+
+   while (w->n_lat + 2 * live <= w->opt->ops) {
+      long i;
+      for (i = 0; i < live; i++) {
+         sizes[i] = whatObjectSize(w);
+         objects[i] = timedMalloc(w, sizes[i]);
+         perm[i] = i;
+      }
+      if (strcmp(order, "random") == 0) {
+         for (i = live - 1; i > 0; i--) {
+            long j = whatRandom(w) % (i + 1);
+            long tmp = perm[i];
+            perm[i] = perm[j];
+            perm[j] = tmp;
+         }
+      }
+      for (i = 0; i < live; i++) {
+         long at = perm[i];
+         if (strcmp(order, "lifo") == 0) {
+            at = live - 1 - i;
+         }
+         timedFree(w, objects[at], sizes[at]);
+      }
+   }
+   free(objects);
+   free(sizes);
+   free(perm);
+   return NULL;
+}
+
+// prodcons producer: allocates objects and passes them to its partner.
+void *runProducer(void *arg)
+{
+   worker_t *w = arg;
+   long n = w->opt->ops;
+   long i;
+   for (i = 0; i < n; i++) {
+      // The size travels in the object's first word (objects are at
+      // least a word), so the consumer can keep its live count.
+      size_t size = whatObjectSize(w);
+      if (size < sizeof(size_t)) {
+         size = sizeof(size_t);
+      }
+      size_t *object = timedMalloc(w, size);
+      if (object == NULL) {
+         continue;
+      }
+      *object = size;
+      while (*w->head - __atomic_load_n(w->tail, __ATOMIC_ACQUIRE)
+         == RING_SIZE) {
+         sched_yield();
+      }
+      w->ring[*w->head % RING_SIZE] = object;
+      __atomic_store_n(w->head, *w->head + 1, __ATOMIC_RELEASE);
+   }
+   while (*w->head - __atomic_load_n(w->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+      sched_yield();
+   }
+   w->ring[*w->head % RING_SIZE] = NULL;   // no more to come
+   __atomic_store_n(w->head, *w->head + 1, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+// prodcons consumer: frees what its partner allocated.
+void *runConsumer(void *arg)
+{
+   worker_t *w = arg;
+   for (;;) {
+      while (__atomic_load_n(w->head, __ATOMIC_ACQUIRE) == *w->tail) {
+         sched_yield();
+      }
+      size_t *object = w->ring[*w->tail % RING_SIZE];
+      __atomic_store_n(w->tail, *w->tail + 1, __ATOMIC_RELEASE);
+      if (object == NULL) {
+         break;
+      }
+      timedFree(w, object, 0);
+   }
+   return NULL;
+}
+
+// churn: keeps live objects of mixed sizes, replacing a random one at
+// each step, so that free space is left scattered between live blocks.
+void *runChurn(void *arg)
+{
+   worker_t *w = arg;
+   long live = w->opt->live;
+   void **objects = calloc(live, sizeof(void *));
+   size_t *sizes = calloc(live, sizeof(size_t));
+
+   while (w->n_lat + 2 <= w->opt->ops) {
+      long at = whatRandom(w) % live;
+      if (objects[at] != NULL) {
+         timedFree(w, objects[at], sizes[at]);
+      }
+      sizes[at] = whatObjectSize(w);
+      objects[at] = timedMalloc(w, sizes[at]);
+   }
+   long i;
+   for (i = 0; i < live; i++) {
+      if (objects[i] != NULL) {
+         w->alloc->free(objects[i]);
+      }
+   }
+   free(objects);
+   free(sizes);
+   return NULL;
+}
+
+// Times one malloc, keeping the latency and live byte count.
+void *timedMalloc(worker_t *w, size_t n)
+{
+   unsigned long long before = whatTime();
+   void *object = w->alloc->malloc(n);
+   unsigned long long after = whatTime();
+   w->lat[w->n_lat++] = after - before;
+   if (object == NULL) {
+      w->failed++;
+      return NULL;
+   }
+   // Touch the object, as a real program would.
+   *(volatile char *)object = 1;
+   w->live += n;
+   if (w->live > w->peak_live) {
+      w->peak_live = w->live;
+   }
+   return object;
+}
+
+// Times one free, keeping the latency and live byte count. n is 0 if
+// the object was counted live by some other thread.
+void timedFree(worker_t *w, void *object, size_t n)
+{
+   if (object == NULL) {
+      return;
+   }
+   unsigned long long before = whatTime();
+   w->alloc->free(object);
+   unsigned long long after = whatTime();
+   w->lat[w->n_lat++] = after - before;
+   w->live -= n;
+}
+
+// Function that returns a pseudo-random number (xorshift64*).
+unsigned long long whatRandom(worker_t *w)
+{
+   w->rng ^= w->rng >> 12;
+   w->rng ^= w->rng << 25;
+   w->rng ^= w->rng >> 27;
+   return w->rng * 0x2545F4914F6CDD1Dull;
+}
+
+// Function that returns the size of the next object to allocate.
+size_t whatObjectSize(worker_t *w)
+{
+   const options_t *opt = w->opt;
+   double u = (whatRandom(w) >> 11) * (1.0 / 9007199254740992.0);
+   if (!opt->powerlaw) {
+      return opt->min + (size_t)(u * (opt->max - opt->min + 1));
+   }
+   // Pareto with shape 1: P(size > x) = min / x, cut off at max.
+   double size = opt->min / (1.0 - u);
+   return (size >= opt->max) ? opt->max : (size_t)size;
+}
+
+// Function that returns the monotonic clock in ns.
+unsigned long long whatTime(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Orders latencies, for qsort().
+int compareLatency(const void *x, const void *y)
+{
+   unsigned int a = *(const unsigned int *)x;
+   unsigned int b = *(const unsigned int *)y;
+   return (a > b) - (a < b);
+}
@@ -0,0 +1,97 @@
+//
+// Vlad: the memory allocator
+// doublefree.c ... check that freeing a block twice is caught
+//
+// Build:   gcc -O2 -o doublefree doublefree.c allocator.c -lpthread
+// Usage:   ./doublefree
+//
+// Frees a pair of buddy blocks, so that they merge, then frees the upper
+// one again, which must abort rather than corrupt the free lists. Each
+// case runs in a child process of its own: with headers and without
+// (VLAD_NO_HEADERS), freeing the pair one at a time and as a batch.
+// Prints a line per case, and exits non-zero if any free went unnoticed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "allocator.h"
+
+#define ARENA_SIZE (1 << 20)
+#define BLOCK_SIZE 128
+
+// Frees a pair of buddies in an arena with the given flags, one at a
+// time or as a batch, and then the upper one again.
+static void freeTwice(int flags, int batch)
+{
+   vlad_arena_t *a = vlad_arena_create_flags(ARENA_SIZE, flags);
+   if (a == NULL) {
+      _exit(2);
+   }
+   void *pair[2];
+   pair[0] = vlad_arena_malloc(a, BLOCK_SIZE);
+   pair[1] = vlad_arena_malloc(a, BLOCK_SIZE);
+   if (pair[0] > pair[1]) {
+      void *t = pair[0];
+      pair[0] = pair[1];
+      pair[1] = t;
+   }
+   if (batch) {
+      vlad_arena_free_batch(a, pair, 2);
+   } else {
+      vlad_arena_free(a, pair[0]);
+      vlad_arena_free(a, pair[1]);
+   }
+   vlad_arena_free(a, pair[1]);
+   _exit(0);
+}
+
+// Runs freeTwice() in a child, and returns whether it aborted.
+static int caught(int flags, int batch)
+{
+   fflush(stdout);   // so that the child has nothing of ours to write
+   pid_t pid = fork();
+   if (pid < 0) {
+      perror("fork");
+      exit(2);
+   }
+   if (pid == 0) {
+      // The abort message is expected; keep it out of the report.
+      int null = open("/dev/null", O_WRONLY);
+      if (null >= 0) {
+         dup2(null, 2);
+      }
+      freeTwice(flags, batch);
+   }
+   int status;
+   if (waitpid(pid, &status, 0) < 0) {
+      perror("waitpid");
+      exit(2);
+   }
+   return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+int main(void)
+{
+   static const struct {
+      const char *name;
+      int flags;
+      int batch;
+   } cases[] = {
+      {"headers, one at a time", 0, 0},
+      {"headers, batch", 0, 1},
+      {"no headers, one at a time", VLAD_NO_HEADERS, 0},
+      {"no headers, batch", VLAD_NO_HEADERS, 1},
+   };
+   int missed = 0;
+   size_t i;
+   for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+      int ok = caught(cases[i].flags, cases[i].batch);
+      printf("%-28s %s\n", cases[i].name, ok ? "caught" : "NOT CAUGHT");
+      missed += !ok;
+   }
+   return missed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+//
+// Vlad: the memory allocator
+// heapmap.c ... summarise and draw a heap snapshot
+//
+// Build:   gcc -O2 -o heapmap heapmap.c
+// Usage:   ./heapmap [-w columns] [-r rows] snapshot-file
+//
+// Reads a snapshot written by vlad_snapshot() (see snapshot.h), "-" for
+// standard input, and for each arena and region in it prints how many
+// bytes are free, in use, in slabs and on quick lists, the largest free
+// block, and a map of rows x columns cells. Each cell covers an equal
+// share of the arena and shows the state most of its bytes are in:
+//
+//    .  free      #  in use      s  slab      q  quick list
+//
+// and a blank if the snapshot says nothing of it (the region went while
+// being written).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+#define N_STATES 4
+
+static const char state_chars[N_STATES] = {'.', '#', 's', 'q'};
+static const char *state_names[N_STATES] = {"free", "used", "slab", "quick"};
+
+// Functions prototypes:
+
+// Reads one section's runs from f and prints what is in it. Returns 0,
+// or -1 if the snapshot ends early.
+int showArena(FILE *f, snapshot_arena_t *section, int n, int columns,
+              int rows);
+
+// Adds bytes from offset to end, all in state, to the cells they cover.
+void addToCells(u_int64_t (*cells)[N_STATES], int n_cells, u_int64_t size,
+                u_int64_t offset, u_int64_t end, int state);
+
+int main(int argc, char *argv[])
+{
+   int columns = 64;
+   int rows = 16;
+   int c;
+   while ((c = getopt(argc, argv, "w:r:")) != -1) {
+      switch (c) {
+      case 'w': columns = atoi(optarg); break;
+      case 'r': rows = atoi(optarg); break;
+      default: optind = argc + 1; break;
+      }
+   }
+   if (optind != argc - 1 || columns <= 0 || rows <= 0) {
+      fprintf(stderr, "usage: %s [-w columns] [-r rows] snapshot-file\n",
+         argv[0]);
+      return 1;
+   }
+
+   FILE *f = (strcmp(argv[optind], "-") == 0) ? stdin
+                                              : fopen(argv[optind], "rb");
+   snapshot_header_t header;
+   if (f == NULL || fread(&header, sizeof(header), 1, f) != 1
+      || header.magic != SNAPSHOT_MAGIC
+      || header.version != SNAPSHOT_VERSION) {
+      fprintf(stderr, "%s: %s is not a snapshot\n", argv[0], argv[optind]);
+      return 1;
+   }
+   printf("headers of %u bytes, smallest block %llu bytes\n",
+      header.header_size, 1ull << header.min_order);
+
+   snapshot_arena_t section;
+   int n = 0;
+   while (fread(&section, sizeof(section), 1, f) == 1 && section.size != 0) {
+      if (showArena(f, &section, n++, columns, rows) < 0) {
+         fprintf(stderr, "%s: %s ends early\n", argv[0], argv[optind]);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// Reads one section's runs from f and prints what is in it.
+int showArena(FILE *f, snapshot_arena_t *section, int n, int columns,
+              int rows)
+{
+   int n_cells = columns * rows;
+   u_int64_t (*cells)[N_STATES] = calloc(n_cells, sizeof(*cells));
+   u_int64_t bytes[N_STATES] = {0};
+   u_int64_t largest = 0;
+   long n_runs = 0;
+   if (cells == NULL) {
+      fprintf(stderr, "heapmap: out of memory\n");
+      exit(1);
+   }
+
+   snapshot_run_t run;
+   for (;;) {
+      if (fread(&run, sizeof(run), 1, f) != 1) {
+         free(cells);
+         return -1;
+      }
+      if (run.count == 0) {
+         break;
+      }
+      n_runs++;
+      int state = (run.state < N_STATES) ? run.state : SNAPSHOT_USED;
+      u_int64_t block = 1ull << run.order;
+      u_int64_t end = run.offset + run.count * block;
+      if (end > section->size) {
+         end = section->size;
+      }
+      bytes[state] += end - run.offset;
+      if (state == SNAPSHOT_FREE && block > largest) {
+         largest = block;
+      }
+      addToCells(cells, n_cells, section->size, run.offset, end, state);
+   }
+
+   printf("\n%s %d at %#llx: %llu bytes, flags %#x, %ld runs\n",
+      section->is_region ? "region" : "arena", n,
+      (unsigned long long)section->base, (unsigned long long)section->size,
+      section->flags, n_runs);
+   int s;
+   for (s = 0; s < N_STATES; s++) {
+      printf("  %-5s %14llu bytes (%5.1f%%)\n", state_names[s],
+         (unsigned long long)bytes[s], 100.0 * bytes[s] / section->size);
+   }
+   printf("  largest free block %llu bytes\n", (unsigned long long)largest);
+
+   int i;
+   for (i = 0; i < n_cells; i++) {
+      int most = -1;
+      u_int64_t mostBytes = 0;
+      for (s = 0; s < N_STATES; s++) {
+         if (cells[i][s] > mostBytes) {
+            most = s;
+            mostBytes = cells[i][s];
+         }
+      }
+      putchar((most < 0) ? ' ' : state_chars[most]);
+      if ((i + 1) % columns == 0) {
+         putchar('\n');
+      }
+   }
+   free(cells);
+   return 0;
+}
+
+// Adds bytes from offset to end, all in state, to the cells they cover.
+void addToCells(u_int64_t (*cells)[N_STATES], int n_cells, u_int64_t size,
+                u_int64_t offset, u_int64_t end, int state)
+{
+   // Cell i covers [i * size / n_cells, (i + 1) * size / n_cells).
+   while (offset < end) {
+      int i = (int)((double)offset / size * n_cells);
+      if (i >= n_cells) {
+         i = n_cells - 1;
+      }
+      u_int64_t cellEnd = (u_int64_t)((double)(i + 1) * size / n_cells);
+      if (cellEnd <= offset) {
+         cellEnd = offset + 1;
+      }
+      u_int64_t upTo = (end < cellEnd) ? end : cellEnd;
+      cells[i][state] += upTo - offset;
+      offset = upTo;
+   }
+}
@@ -0,0 +1,266 @@
+//
+// Vlad: the memory allocator
+// replay.c ... replay a recorded allocation trace
+//
+// Build:   gcc -O2 -o replay replay.c allocator.c -lpthread
+// Usage:   ./replay [-a vlad|libc] [-H arena bytes] trace-file
+//
+// Replays, as fast as it can and in one thread, the calls recorded in a
+// trace file by vlad_trace_start() (see trace.h), against vlad or against
+// the C library's malloc. Blocks are told apart by the offset they had
+// when recorded, so any number of them can be live at once. A trace whose
+// ring has wrapped starts part way through; frees of blocks allocated
+// before its first record are skipped and counted.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "allocator.h"
+#include "trace.h"
+
+// Live blocks, by recorded offset, in an open-addressing hash table.
+typedef struct handle {
+   int64_t offset;
+   void *object;       // NULL iff the entry is empty
+} handle_t;
+
+typedef struct handles {
+   handle_t *table;
+   size_t size;        // a power of two
+   size_t used;
+} handles_t;
+
+static int useLibc = 0;
+
+// Functions prototypes:
+
+// Calls the allocator being replayed against.
+void *doMalloc(size_t n);
+void doFree(void *object);
+void *doRealloc(void *object, size_t n);
+
+// Records that offset is now object, or takes offset out of the table
+// and returns its object (NULL if it was not there).
+void putHandle(handles_t *h, int64_t offset, void *object);
+void *takeHandle(handles_t *h, int64_t offset);
+
+// Function that returns the table slot offset hashes to.
+size_t whatSlot(handles_t *h, int64_t offset);
+
+int main(int argc, char *argv[])
+{
+   size_t heap = 64 << 20;
+   int c;
+   while ((c = getopt(argc, argv, "a:H:")) != -1) {
+      switch (c) {
+      case 'a': useLibc = (strcmp(optarg, "libc") == 0); break;
+      case 'H': heap = strtoul(optarg, NULL, 0); break;
+      default: optind = argc + 1; break;
+      }
+   }
+   if (optind != argc - 1) {
+      fprintf(stderr, "usage: %s [-a vlad|libc] [-H arena bytes] "
+         "trace-file\n", argv[0]);
+      return 1;
+   }
+
+   int fd = open(argv[optind], O_RDONLY);
+   struct stat st;
+   if (fd < 0 || fstat(fd, &st) < 0
+      || (size_t)st.st_size < sizeof(trace_header_t)) {
+      fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[optind]);
+      return 1;
+   }
+   trace_header_t *header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                 fd, 0);
+   close(fd);
+   if (header == MAP_FAILED || header->magic != TRACE_MAGIC
+      || header->version != TRACE_VERSION || header->capacity == 0
+      || (size_t)st.st_size < sizeof(trace_header_t)
+         + header->capacity * sizeof(trace_record_t)) {
+      fprintf(stderr, "%s: %s is not a trace\n", argv[0], argv[optind]);
+      return 1;
+   }
+   trace_record_t *ring = (trace_record_t *)(header + 1);
+   u_int64_t first = 0;
+   if (header->written > header->capacity) {
+      first = header->written - header->capacity;
+   }
+
+   if (!useLibc) {
+      vlad_init(heap);
+   }
+   handles_t h = {calloc(1024, sizeof(handle_t)), 1024, 0};
+   long ops = 0;
+   long skipped = 0;
+   long failed = 0;
+
+   struct timespec start, end;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   u_int64_t i;
+   for (i = first; i < header->written; i++) {
+      trace_record_t *r = &ring[i % header->capacity];
+      void *object;
+      switch (r->op) {
+      case TRACE_MALLOC:
+         object = doMalloc(r->size);
+         if (object == NULL) {
+            failed++;
+         } else if (r->offset == TRACE_FAILED) {
+            doFree(object);   // it failed when recorded; keep in step
+         } else {
+            putHandle(&h, r->offset, object);
+         }
+         ops++;
+         break;
+      case TRACE_FREE:
+         object = takeHandle(&h, r->offset);
+         if (object == NULL) {
+            skipped++;
+            break;
+         }
+         doFree(object);
+         ops++;
+         break;
+      case TRACE_REALLOC:
+         if (i + 1 == header->written) {
+            break;   // cut off before its TRACE_MOVED
+         }
+         trace_record_t *moved = &ring[(i + 1) % header->capacity];
+         i++;
+         object = takeHandle(&h, r->offset);
+         if (object == NULL) {
+            skipped++;
+            break;
+         }
+         void *result = doRealloc(object, r->size);
+         if (result == NULL) {
+            failed++;
+            result = object;
+         }
+         if (moved->offset != TRACE_FAILED) {
+            putHandle(&h, moved->offset, result);
+         } else {
+            putHandle(&h, r->offset, result);
+         }
+         ops++;
+         break;
+      default:
+         skipped++;   // e.g. a TRACE_MOVED whose TRACE_REALLOC was lost
+         break;
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   double secs = (end.tv_sec - start.tv_sec)
+      + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+   printf("%s: %ld calls in %.3fs (%.0f calls/s), %ld skipped, "
+      "%ld failed, %zu live at end\n", useLibc ? "libc" : "vlad", ops,
+      secs, secs > 0 ? ops / secs : 0, skipped, failed, h.used);
+
+   size_t k;
+   for (k = 0; k < h.size; k++) {
+      if (h.table[k].object != NULL) {
+         doFree(h.table[k].object);
+      }
+   }
+   free(h.table);
+   if (!useLibc) {
+      vlad_end();
+   }
+   return 0;
+}
+
+// Calls the allocator being replayed against.
+void *doMalloc(size_t n)
+{
+   return useLibc ? malloc(n) : vlad_malloc(n);
+}
+
+void doFree(void *object)
+{
+   if (useLibc) {
+      free(object);
+   } else {
+      vlad_free(object);
+   }
+}
+
+void *doRealloc(void *object, size_t n)
+{
+   return useLibc ? realloc(object, n) : vlad_realloc(object, n);
+}
+
+// Records that offset is now object.
+void putHandle(handles_t *h, int64_t offset, void *object)
+{
+   // Keep the table at most half full, doubling it as needed.
+   if (2 * (h->used + 1) > h->size) {
+      handles_t bigger = {calloc(2 * h->size, sizeof(handle_t)),
+                          2 * h->size, 0};
+      if (bigger.table == NULL) {
+         fprintf(stderr, "replay: out of memory\n");
+         exit(1);
+      }
+      size_t k;
+      for (k = 0; k < h->size; k++) {
+         if (h->table[k].object != NULL) {
+            putHandle(&bigger, h->table[k].offset, h->table[k].object);
+         }
+      }
+      free(h->table);
+      *h = bigger;
+   }
+
+   size_t slot = whatSlot(h, offset);
+   while (h->table[slot].object != NULL && h->table[slot].offset != offset) {
+      slot = (slot + 1) & (h->size - 1);
+   }
+   if (h->table[slot].object == NULL) {
+      h->used++;
+   }
+   h->table[slot].offset = offset;
+   h->table[slot].object = object;
+}
+
+// Takes offset out of the table and returns its object (NULL if it was
+// not there).
+void *takeHandle(handles_t *h, int64_t offset)
+{
+   size_t slot = whatSlot(h, offset);
+   while (h->table[slot].object != NULL && h->table[slot].offset != offset) {
+      slot = (slot + 1) & (h->size - 1);
+   }
+   void *object = h->table[slot].object;
+   if (object == NULL) {
+      return NULL;
+   }
+
+   // Close the gap, moving back any later entry of the same run that
+   // could not sit in its own slot, so that lookups never stop short.
+   size_t gap = slot;
+   size_t next = (slot + 1) & (h->size - 1);
+   while (h->table[next].object != NULL) {
+      size_t home = whatSlot(h, h->table[next].offset);
+      if (((next - home) & (h->size - 1)) >= ((next - gap) & (h->size - 1))) {
+         h->table[gap] = h->table[next];
+         gap = next;
+      }
+      next = (next + 1) & (h->size - 1);
+   }
+   h->table[gap].object = NULL;
+   h->used--;
+   return object;
+}
+
+// Function that returns the table slot offset hashes to.
+size_t whatSlot(handles_t *h, int64_t offset)
+{
+   return ((u_int64_t)offset * 0x9E3779B97F4A7C15ull >> 17) & (h->size - 1);
+}
@@ -0,0 +1,321 @@
+//
+// Vlad: the memory allocator
+// shim.c ... vlad in place of the C library's malloc
+//
+// Build:   gcc -O2 -shared -fPIC -ftls-model=initial-exec
+//              -o libvlad.so shim.c allocator.c -lpthread
+// Usage:   LD_PRELOAD=./libvlad.so some-program
+//
+// Exports malloc(), free(), calloc(), realloc(), posix_memalign(),
+// aligned_alloc(), malloc_usable_size() and the older memalign(),
+// valloc(), pvalloc() and reallocarray() (so that no block can come from
+// one allocator and go back to another), all backed by vlad's arenas.
+// The heap is set up on the first call, with one arena per CPU of
+// VLAD_ARENA_SIZE bytes (from the environment, 64MB by default).
+//
+// - Bootstrap: anything allocated while the heap is still being set up
+//   (by the C library, from inside vlad_init_threads()) comes from a
+//   small static buffer, and is never freed.
+// - Fork safety: vlad holds all of its locks over fork().
+// - Fallback: a request vlad cannot serve is mapped straight from the OS
+//   as a block of its own, so it only fails if the OS is out of memory.
+
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "allocator.h"
+
+#define DEFAULT_ARENA_SIZE (64 << 20)
+#define BOOT_SIZE          (64 << 10) // bytes in the bootstrap buffer
+#define MIN_ALIGN          16         // what malloc() must align to
+#define FALLBACK_MAGIC     0x56464c42 // "BLFV", in front of fallback blocks
+
+// Header in front of bootstrap and fallback blocks; vlad's blocks have
+// their own. offset is how far back the mapping starts, for aligned ones.
+typedef struct shim_header {
+   size_t size;       // bytes usable after the header
+   u_int32_t magic;   // FALLBACK_MAGIC for fallback blocks
+   u_int32_t offset;  // bytes from the mapping's start to the header
+} shim_header_t;
+
+static unsigned char boot[BOOT_SIZE] __attribute__((aligned(MIN_ALIGN)));
+static size_t boot_used;
+
+static int ready;                       // set once the heap is set up
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int initialising;       // this thread is setting it up
+
+// Functions prototypes:
+
+// Sets up vlad's heap, once.
+void shimInit(void);
+
+// Allocation from the bootstrap buffer.
+void *bootMalloc(size_t n);
+
+// Function that returns whether object is in the bootstrap buffer.
+int isBoot(void *object);
+
+// Allocation straight from the OS, for what vlad cannot serve.
+void *fallbackMalloc(size_t alignment, size_t n);
+void fallbackFree(void *object);
+
+// Function that returns the header in front of a bootstrap or
+// fallback block.
+shim_header_t *whatShimHeader(void *object);
+
+// malloc() with the given alignment (a power of two), from vlad if it
+// can, and from the OS otherwise.
+void *shimMalloc(size_t alignment, size_t n);
+
+void *malloc(size_t n)
+{
+   return shimMalloc(1, n);
+}
+
+void free(void *object)
+{
+   if (object == NULL || isBoot(object)) {
+      return;
+   }
+   if (vlad_owns(object)) {
+      vlad_free(object);
+   } else {
+      fallbackFree(object);
+   }
+}
+
+void *calloc(size_t count, size_t size)
+{
+   if (size != 0 && count > SIZE_MAX / size) {
+      errno = ENOMEM;
+      return NULL;
+   }
+   if (!ready && initialising) {
+      return bootMalloc(count * size);   // the buffer starts out zero
+   }
+   shimInit();
+   // The 8-byte slab slots are too small to be aligned as malloc()'s are.
+   if (count * size < MIN_ALIGN) {
+      count = 1;
+      size = MIN_ALIGN;
+   }
+   void *object = vlad_calloc(count, size);
+   if (object == NULL) {
+      object = fallbackMalloc(1, count * size);   // fresh pages are zero
+   }
+   return object;
+}
+
+void *realloc(void *object, size_t n)
+{
+   if (object == NULL) {
+      return malloc(n);
+   }
+   if (n == 0) {
+      free(object);
+      return NULL;
+   }
+   if (!isBoot(object) && vlad_owns(object)) {
+      void *moved = vlad_realloc(object, (n < MIN_ALIGN) ? MIN_ALIGN : n);
+      if (moved != NULL) {
+         return moved;
+      }
+   }
+
+   // Bootstrap and fallback blocks, and vlad's when vlad has no room:
+   // move to wherever malloc() puts it now.
+   size_t size = malloc_usable_size(object);
+   void *moved = malloc(n);
+   if (moved != NULL) {
+      memcpy(moved, object, (size < n) ? size : n);
+      free(object);
+   }
+   return moved;
+}
+
+void *reallocarray(void *object, size_t count, size_t size)
+{
+   if (size != 0 && count > SIZE_MAX / size) {
+      errno = ENOMEM;
+      return NULL;
+   }
+   return realloc(object, count * size);
+}
+
+int posix_memalign(void **result, size_t alignment, size_t n)
+{
+   if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+      return EINVAL;
+   }
+   void *object = shimMalloc(alignment, n);
+   if (object == NULL) {
+      return ENOMEM;
+   }
+   *result = object;
+   return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t n)
+{
+   if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+      errno = EINVAL;
+      return NULL;
+   }
+   return shimMalloc(alignment, n);
+}
+
+void *memalign(size_t alignment, size_t n)
+{
+   return aligned_alloc(alignment, n);
+}
+
+void *valloc(size_t n)
+{
+   return shimMalloc(sysconf(_SC_PAGESIZE), n);
+}
+
+void *pvalloc(size_t n)
+{
+   size_t page = sysconf(_SC_PAGESIZE);
+   return shimMalloc(page, (n + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *object)
+{
+   if (object == NULL) {
+      return 0;
+   }
+   if (!isBoot(object) && vlad_owns(object)) {
+      return vlad_usable_size(object);
+   }
+   return whatShimHeader(object)->size;
+}
+
+// malloc() with the given alignment (a power of two), from vlad if it
+// can, and from the OS otherwise.
+void *shimMalloc(size_t alignment, size_t n)
+{
+   if (!ready && initialising && alignment <= MIN_ALIGN) {
+      return bootMalloc(n);
+   }
+   shimInit();
+   // Every block vlad hands out is at least MIN_ALIGN-aligned except
+   // the 8-byte slab slots, so only bigger alignments need more.
+   void *object;
+   if (alignment <= MIN_ALIGN) {
+      object = vlad_malloc((n < MIN_ALIGN) ? MIN_ALIGN : n);
+   } else {
+      object = vlad_memalign(alignment, n);
+   }
+   if (object == NULL) {
+      object = fallbackMalloc(alignment, n);
+   }
+   return object;
+}
+
+// Sets up vlad's heap, once.
+void shimInit(void)
+{
+   if (__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+      return;
+   }
+   initialising = 1;
+   pthread_mutex_lock(&init_lock);
+   if (!ready) {
+      size_t size = DEFAULT_ARENA_SIZE;
+      char *env = getenv("VLAD_ARENA_SIZE");
+      if (env != NULL && strtoul(env, NULL, 0) > 0) {
+         size = strtoul(env, NULL, 0);
+      }
+      vlad_init_threads(size, 0);
+      __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&init_lock);
+   initialising = 0;
+}
+
+// Allocation from the bootstrap buffer.
+void *bootMalloc(size_t n)
+{
+   size_t need = (sizeof(shim_header_t) + n + MIN_ALIGN - 1)
+      & ~(size_t)(MIN_ALIGN - 1);
+   size_t at = __atomic_fetch_add(&boot_used, need, __ATOMIC_RELAXED);
+   if (n > BOOT_SIZE || at + need > BOOT_SIZE) {
+      errno = ENOMEM;
+      return NULL;
+   }
+   shim_header_t *header = (shim_header_t *)(boot + at);
+   header->size = need - sizeof(shim_header_t);
+   return header + 1;
+}
+
+// Function that returns whether object is in the bootstrap buffer.
+int isBoot(void *object)
+{
+   return (unsigned char *)object >= boot
+      && (unsigned char *)object < boot + BOOT_SIZE;
+}
+
+// Allocation straight from the OS, for what vlad cannot serve.
+void *fallbackMalloc(size_t alignment, size_t n)
+{
+   size_t page = sysconf(_SC_PAGESIZE);
+   size_t lead = sizeof(shim_header_t);
+   if (alignment > lead) {
+      lead = alignment;   // keeps the data aligned, as pages are
+   }
+   if (n > SIZE_MAX - lead - page || alignment > UINT32_MAX / 2) {
+      errno = ENOMEM;
+      return NULL;
+   }
+   size_t total = (lead + n + page - 1) & ~(page - 1);
+   unsigned char *mem = mmap(NULL, total, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (mem == MAP_FAILED) {
+      errno = ENOMEM;
+      return NULL;
+   }
+   // For alignments beyond a page, step up to the next aligned spot.
+   unsigned char *data = mem + lead;
+   if (alignment > page && ((uintptr_t)data & (alignment - 1)) != 0) {
+      munmap(mem, total);
+      total += alignment;
+      mem = mmap(NULL, total, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mem == MAP_FAILED) {
+         errno = ENOMEM;
+         return NULL;
+      }
+      data = (unsigned char *)(((uintptr_t)mem + sizeof(shim_header_t)
+         + alignment - 1) & ~(uintptr_t)(alignment - 1));
+   }
+   shim_header_t *header = whatShimHeader(data);
+   header->size = mem + total - data;
+   header->magic = FALLBACK_MAGIC;
+   header->offset = (unsigned char *)header - mem;
+   return data;
+}
+
+void fallbackFree(void *object)
+{
+   shim_header_t *header = whatShimHeader(object);
+   if (header->magic != FALLBACK_MAGIC) {
+      abort();   // not from any allocator here
+   }
+   unsigned char *mem = (unsigned char *)header - header->offset;
+   munmap(mem, (unsigned char *)object + header->size - mem);
+}
+
+// Function that returns the header in front of a bootstrap or
+// fallback block.
+shim_header_t *whatShimHeader(void *object)
+{
+   return (shim_header_t *)object - 1;
+}
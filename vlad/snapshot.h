@@ -0,0 +1,51 @@
+//
+// Vlad: the memory allocator
+// snapshot.h ... format of heap snapshots
+//
+// vlad_snapshot() writes a snapshot_header_t, then for each arena and
+// region a snapshot_arena_t followed by its blocks, in address order, as
+// snapshot_run_t's; a run with count 0 ends each arena. A
+// snapshot_arena_t with size 0 ends the snapshot.
+//
+// Each arena is walked a chunk at a time, with its lock held only for
+// the chunk, so a snapshot of a heap in use is not of a single moment:
+// a run may overlap one before it if blocks merged in between chunks.
+// Runs carry their own offsets so that a reader can tell.
+
+#ifndef VLAD_SNAPSHOT_H
+#define VLAD_SNAPSHOT_H
+
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC    0x53444c56 // "VLDS"
+#define SNAPSHOT_VERSION  1
+
+// Block states.
+#define SNAPSHOT_FREE     0 // on a free list
+#define SNAPSHOT_USED     1 // allocated
+#define SNAPSHOT_SLAB     2 // allocated, as a slab of small slots
+#define SNAPSHOT_QUICK    3 // freed, on a quick list (VLAD_LAZY)
+
+typedef struct snapshot_header {
+   uint32_t magic;       // ought to contain SNAPSHOT_MAGIC
+   uint32_t version;     // ought to contain SNAPSHOT_VERSION
+   uint32_t header_size; // bytes in front of data in a headed block
+   uint32_t min_order;   // order of the smallest block
+} snapshot_header_t;
+
+typedef struct snapshot_arena {
+   uint64_t base;        // address of the arena's memory when written
+   uint64_t size;        // bytes in the arena, or 0 at the end
+   uint32_t flags;       // VLAD_* flags of the arena
+   uint32_t is_region;   // 1 if the heap grew into it, else 0
+} snapshot_arena_t;
+
+typedef struct snapshot_run {
+   uint64_t offset;      // where the first block starts, from base
+   uint32_t count;       // # blocks side by side, or 0 at the end
+   uint8_t order;        // each block is 2^order bytes
+   uint8_t state;        // SNAPSHOT_*
+   uint8_t pad[2];
+} snapshot_run_t;
+
+#endif
@@ -0,0 +1,46 @@
+//
+// Vlad: the memory allocator
+// trace.h ... format of allocation trace files
+//
+// vlad_trace_start() records each vlad_malloc(), vlad_free() and so on
+// into a file made of a trace_header_t followed by a ring of `capacity`
+// trace_record_t's. Record i (counting from 0 since the trace started)
+// is kept in slot i % capacity, so once the ring wraps it holds the
+// latest `capacity` records: those from written - capacity on.
+
+#ifndef VLAD_TRACE_H
+#define VLAD_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC    0x54444c56 // "VLDT"
+#define TRACE_VERSION  1
+
+// Record operations. vlad_calloc(), vlad_memalign() and the batch
+// functions are recorded as the single mallocs and frees they amount to.
+// A realloc is two records side by side: TRACE_REALLOC with the size and
+// the old block, then TRACE_MOVED with the new block (which is the old
+// one if it was resized in place, or TRACE_FAILED if it could not be).
+#define TRACE_MALLOC   1
+#define TRACE_FREE     2
+#define TRACE_REALLOC  3
+#define TRACE_MOVED    4
+
+#define TRACE_FAILED   INT64_MIN // offset of a block that was not given
+
+typedef struct trace_header {
+   uint32_t magic;       // ought to contain TRACE_MAGIC
+   uint32_t version;     // ought to contain TRACE_VERSION
+   uint64_t capacity;    // # records the ring holds
+   uint64_t written;     // # records ever written
+} trace_header_t;
+
+typedef struct trace_record {
+   uint32_t delta;       // ns since the thread's previous record (capped)
+   uint8_t op;           // TRACE_*
+   uint8_t pad[3];
+   uint64_t size;        // bytes requested, for TRACE_MALLOC/TRACE_REALLOC
+   int64_t offset;       // block, by where it is from the start of the heap
+} trace_record_t;
+
+#endif
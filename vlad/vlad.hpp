@@ -0,0 +1,254 @@
+//
+// Vlad: the memory allocator
+// vlad.hpp ... C++ interface
+//
+// Header-only; needs C++17, and allocator.c compiled and linked in
+// (it is C, so build it with a C compiler), with VLAD_SMALL_HEADERS
+// defined for both or for neither.
+//
+// vlad::arena           - owns a vlad_arena_t, destroying it (and every
+//                         block still in it) when it goes
+// vlad::memory_resource - a std::pmr::memory_resource over an arena, so
+//                         that std::pmr containers can live in one
+// vlad::allocator<T>    - an allocator for standard containers, over an
+//                         arena or the default heap
+//
+//    vlad::arena a(1 << 20);
+//    vlad::memory_resource r(a);
+//    std::pmr::vector<int> v(&r);
+//    std::vector<int, vlad::allocator<int>> w{vlad::allocator<int>(a)};
+//
+// Nothing here is any more thread-safe than the C functions under it.
+
+#ifndef VLAD_HPP
+#define VLAD_HPP
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+#include "allocator.h"
+
+namespace vlad {
+
+// Function that returns the order (log2) of the smallest power of two
+// that is at least n, at compile time if n is known then.
+constexpr unsigned order_up(std::size_t n)
+{
+   unsigned order = 0;
+   while ((std::size_t(1) << order) < n) {
+      order++;
+   }
+   return order;
+}
+
+// Function that returns whether vlad_malloc(n) and friends already give
+// alignment: every block is 16-byte aligned but the 8-byte slab slots.
+constexpr bool is_aligned_enough(std::size_t n, std::size_t alignment)
+{
+   return alignment <= 8 || (alignment <= 16 && n > 8);
+}
+
+// Allocates n bytes aligned to alignment from a, or from the default
+// heap if a is null. Returns null if there is no room.
+inline void *allocate(vlad_arena_t *a, std::size_t n, std::size_t alignment)
+{
+   if (is_aligned_enough(n, alignment)) {
+      return (a != nullptr) ? vlad_arena_malloc(a, n) : vlad_malloc(n);
+   }
+   return (a != nullptr) ? vlad_arena_memalign(a, alignment, n)
+                         : vlad_memalign(alignment, n);
+}
+
+// Frees what allocate(a, ...) gave.
+inline void deallocate(vlad_arena_t *a, void *object)
+{
+   if (a != nullptr) {
+      vlad_arena_free(a, object);
+   } else {
+      vlad_free(object);
+   }
+}
+
+// An arena, destroyed along with every block in it when it goes.
+class arena {
+public:
+   // A new arena of size bytes (rounded up to a power of two), with the
+   // given VLAD_* flags. Throws std::bad_alloc if it cannot be mapped.
+   explicit arena(std::size_t size, int flags = 0)
+      : a_(vlad_arena_create_flags(size, flags))
+   {
+      if (a_ == nullptr) {
+         throw std::bad_alloc();
+      }
+   }
+
+   // The persistent arena in the file at path, made size bytes if new
+   // (see vlad_open_persistent()); it is closed, not lost, when it goes.
+   static arena open_persistent(const char *path, std::size_t size)
+   {
+      vlad_arena_t *a = vlad_open_persistent(path, size);
+      if (a == nullptr) {
+         throw std::bad_alloc();
+      }
+      return arena(a);
+   }
+
+   arena(const arena &) = delete;
+   arena &operator=(const arena &) = delete;
+
+   arena(arena &&other) noexcept : a_(std::exchange(other.a_, nullptr)) {}
+
+   arena &operator=(arena &&other) noexcept
+   {
+      if (this != &other) {
+         release();
+         a_ = std::exchange(other.a_, nullptr);
+      }
+      return *this;
+   }
+
+   ~arena() { release(); }
+
+   // As vlad_arena_malloc() and friends; null if there is no room.
+   void *malloc(std::size_t n) { return vlad_arena_malloc(a_, n); }
+   void *calloc(std::size_t n) { return vlad_arena_calloc(a_, n); }
+   void *memalign(std::size_t alignment, std::size_t n)
+   {
+      return vlad_arena_memalign(a_, alignment, n);
+   }
+   void *realloc(void *object, std::size_t n)
+   {
+      return vlad_arena_realloc(a_, object, n);
+   }
+   void free(void *object) { vlad_arena_free(a_, object); }
+
+   // The arena itself, for the C functions.
+   vlad_arena_t *get() const noexcept { return a_; }
+
+private:
+   explicit arena(vlad_arena_t *a) noexcept : a_(a) {}
+
+   void release() noexcept
+   {
+      if (a_ != nullptr) {
+         vlad_arena_destroy(a_);
+         a_ = nullptr;
+      }
+   }
+
+   vlad_arena_t *a_;
+};
+
+// A std::pmr::memory_resource handing out blocks of one arena, which
+// must outlive it and everything allocated through it.
+class memory_resource : public std::pmr::memory_resource {
+public:
+   explicit memory_resource(arena &a) noexcept : a_(a.get()) {}
+   explicit memory_resource(vlad_arena_t *a) noexcept : a_(a) {}
+
+   vlad_arena_t *get() const noexcept { return a_; }
+
+private:
+   void *do_allocate(std::size_t bytes, std::size_t alignment) override
+   {
+      void *object = vlad::allocate(a_, bytes, alignment);
+      if (object == nullptr) {
+         throw std::bad_alloc();
+      }
+      return object;
+   }
+
+   void do_deallocate(void *object, std::size_t, std::size_t) override
+   {
+      vlad::deallocate(a_, object);
+   }
+
+   bool do_is_equal(const std::pmr::memory_resource &other)
+      const noexcept override
+   {
+      // Blocks of one arena can be freed through any resource over it.
+      auto *o = dynamic_cast<const memory_resource *>(&other);
+      return o != nullptr && o->a_ == a_;
+   }
+
+   vlad_arena_t *a_;
+};
+
+// An allocator for standard containers. One made from an arena hands out
+// blocks of it, and the arena must outlive it and what it allocates; a
+// default-made one uses the default heap, which must be vlad_init()'d.
+// Containers take their allocator's arena with them when copied, moved
+// or swapped.
+template <typename T>
+class allocator {
+public:
+   using value_type = T;
+   using propagate_on_container_copy_assignment = std::true_type;
+   using propagate_on_container_move_assignment = std::true_type;
+   using propagate_on_container_swap = std::true_type;
+   using is_always_equal = std::false_type;
+
+   // The order of the buddy block a single T takes, header and all, and
+   // whether T's alignment needs vlad_memalign(); both settled by the
+   // compiler, so that allocate(1) from an arena does no sizing work.
+   static constexpr unsigned order = order_up(sizeof(T) + VLAD_HEADER_SIZE);
+   static constexpr bool plain = is_aligned_enough(sizeof(T), alignof(T));
+
+   allocator() noexcept : a_(nullptr) {}
+   allocator(arena &a) noexcept : a_(a.get()) {}
+   explicit allocator(vlad_arena_t *a) noexcept : a_(a) {}
+
+   template <typename U>
+   allocator(const allocator<U> &other) noexcept : a_(other.get()) {}
+
+   T *allocate(std::size_t n)
+   {
+      if (n > std::size_t(-1) / sizeof(T)) {
+         throw std::bad_array_new_length();
+      }
+      void *object;
+      if constexpr (plain) {
+         if (a_ == nullptr) {
+            object = vlad_malloc(n * sizeof(T));
+         } else if (n == 1) {
+            object = vlad_arena_malloc_order(a_, sizeof(T), order);
+         } else {
+            object = vlad_arena_malloc(a_, n * sizeof(T));
+         }
+      } else {
+         object = vlad::allocate(a_, n * sizeof(T), alignof(T));
+      }
+      if (object == nullptr) {
+         throw std::bad_alloc();
+      }
+      return static_cast<T *>(object);
+   }
+
+   void deallocate(T *object, std::size_t) noexcept
+   {
+      vlad::deallocate(a_, object);
+   }
+
+   vlad_arena_t *get() const noexcept { return a_; }
+
+private:
+   vlad_arena_t *a_;
+};
+
+template <typename T, typename U>
+bool operator==(const allocator<T> &x, const allocator<U> &y) noexcept
+{
+   return x.get() == y.get();
+}
+
+template <typename T, typename U>
+bool operator!=(const allocator<T> &x, const allocator<U> &y) noexcept
+{
+   return x.get() != y.get();
+}
+
+} // namespace vlad
+
+#endif